@@ -19,10 +19,16 @@
 #pragma once
 
 #include "block.hpp"
+#include "io.hpp"
+#include "io_worker.hpp"
 #include "io_device.hpp"
 #include "pci_device.hpp"
+#include "pic.hpp"
+#include "hv2/hv2.hpp"
 
 #include <string>
+#include <vector>
+#include <atomic>
 #include <cstring>
 #include <cstdlib>
 
@@ -36,6 +42,11 @@
 #define ATA_CTRL_BEGIN ATA_PRI_CTRL
 #define ATA_CTRL_SIZE  0x3
 
+// Bus master IDE register block (BAR4), secondary channel at +8
+#define ATA_BM_BASE    0xc000
+#define ATA_BM_SIZE    0x10
+
+
 // ATA Registers
 #define ATA_REG_DATA       0x00
 #define ATA_REG_ERROR      0x01
@@ -54,6 +65,28 @@
 #define ATA_REG_CONTROL    0x0c
 #define ATA_REG_ALTSTATUS  0x0c
 #define ATA_REG_DEVADDRESS 0x0d
+#define ATA_REG_BM         0x10 // Not a real register, marks BAR4 accesses
+
+// Bus master registers
+#define ATA_BM_REG_COMMAND 0x00
+#define ATA_BM_REG_STATUS  0x02
+#define ATA_BM_REG_PRDT    0x04
+
+#define ATA_BM_CMD_START   0x01
+#define ATA_BM_CMD_READ    0x08    // 1 - Device to memory, 0 - Memory to device
+
+#define ATA_BM_SR_ACTIVE   0x01
+#define ATA_BM_SR_ERR      0x02    // Write 1 to clear
+#define ATA_BM_SR_IRQ      0x04    // Write 1 to clear
+#define ATA_BM_SR_DRV0_DMA 0x20
+#define ATA_BM_SR_DRV1_DMA 0x40
+
+// Device control register
+#define ATA_CTRL_NIEN      0x02    // Interrupts disabled
+#define ATA_CTRL_SRST      0x04    // Software reset
+
+// Physical Region Descriptor flags
+#define ATA_PRD_EOT        0x8000
 
 // Status Register
 #define ATA_SR_BSY     0x80    // Busy
@@ -89,6 +122,11 @@
 #define ATA_CMD_PACKET            0xA0 // PACKET (ATAPI?)
 #define ATA_CMD_IDENTIFY_PACKET   0xA1 // IDENTIFY PACKET DEVICE (ATAPI?)
 #define ATA_CMD_IDENTIFY          0xEC // IDENTIFY DEVICE
+#define ATA_CMD_READ_MULTIPLE     0xC4 // READ MULTIPLE
+#define ATA_CMD_READ_MULTIPLE_EXT 0x29 // READ MULTIPLE EXT
+#define ATA_CMD_WRITE_MULTIPLE    0xC5 // WRITE MULTIPLE
+#define ATA_CMD_WRITE_MULTIPLE_EXT 0x39 // WRITE MULTIPLE EXT
+#define ATA_CMD_SET_MULTIPLE      0xC6 // SET MULTIPLE MODE
 
 // #IDENTITY fields
 #define ATA_IDENT_DEVICETYPE   0
@@ -110,18 +148,56 @@
 
 #define ATA_SECTOR_SIZE 0x200
 
+// Largest DRQ block (in sectors) accepted by SET MULTIPLE MODE
+#define ATA_MAX_MULTIPLE 16
+
+// Backing-store operations run on the worker pool
+#define ATA_IO_READ  0
+#define ATA_IO_WRITE 1
+#define ATA_IO_FLUSH 2
+#define ATA_IO_DMA   3
+
+#define ATA_WORKERS  4
+
+struct ata_dma_segment_t {
+    uint8_t* ptr;
+    uint32_t size;
+};
+
 struct ata_channel_t {
     int drive_number = ATA_MASTER;
 
+    // Taskfile, index 0 is the current value, the second half holds
+    // the previous write (HOB) for 48-bit commands
+    uint8_t features    = 0;
+    uint8_t seccount[2] = { 0 };
+    uint8_t lba[6]      = { 0 };
+    uint8_t hddevsel    = 0;
+    uint8_t control     = 0;
+
+    // Bus master registers
+    uint8_t  bm_command = 0;
+    uint8_t  bm_status  = 0;
+    uint32_t bm_prdt    = 0;
+
     struct drive_t {
         block_dev_t blk;                        // Each drive gets a block device for outputting to a file
         uint64_t    rw_base_lba;                // This is the base LBA for RW ops
-        uint16_t    rw_sectors;                 // Sector count for RW ops
+        uint32_t    rw_sectors;                 // Sector count for RW ops
         size_t      rw_pending_bytes;           // Pending RWs from the PIO port
-        uint8_t     rw_buf[ATA_SECTOR_SIZE];    // Sector-sized buffer for RW ops
+        size_t      rw_index;                   // Bytes transferred through the PIO port
+        size_t      rw_block_bytes;             // DRQ block size, an IRQ is raised per block
+        std::vector <uint8_t> rw_buf;           // Holds the whole sector run of a PIO command
         bool        rw_direction;               // RW op direction (read, write)
-        uint8_t     error;                      // Drive command error
-        uint8_t     status;                     // Drive status
+        uint8_t     multiple = 0;               // Sectors per block for READ/WRITE MULTIPLE
+        uint8_t     error = 0;                  // Drive command error
+        uint8_t     status = 0;                 // Drive status
+        bool        dma_pending = false;        // DMA command waiting for the bus master
+        bool        dma_direction;              // DMA op direction (read, write)
+        std::vector <ata_dma_segment_t> dma_segments; // Host pointers resolved from the PRD table
+        int         io_op;                      // Operation handed to the worker pool
+        bool        io_ok;                      // Result of io_op, set by the worker
+        std::atomic <bool> io_done = false;     // Set by the worker once io_op is done
     } drive[2];
 };
 
@@ -131,16 +207,31 @@ struct ata_channel_t {
 #define ATA_SEC_SLAVE  3
 
 class io_device_ata_t : public io_device_t {
+    hv2_t* cpu = nullptr;
+    io_device_pic_t* pic = nullptr;
+
     pci_desc_t desc;
 
     // Channel index
     int index = ATA_PRIMARY;
     ata_channel_t channel[2];
 
+    struct ata_job_t {
+        io_device_ata_t* ata;
+        int ch, drv;
+    } jobs[4];
+
+    // Number of finished jobs not yet seen by complete_io()
+    std::atomic <int> completions = 0;
+
+    // Declared after channel so it's joined before the drives go away
+    io_worker_pool_t workers;
+
     uint16_t pri_io_base   = ATA_PRI_IO;
     uint16_t pri_ctrl_base = ATA_PRI_CTRL;
     uint16_t sec_io_base   = ATA_SEC_IO;
     uint16_t sec_ctrl_base = ATA_SEC_CTRL;
+    uint16_t bm_base       = ATA_BM_BASE;
 
 #define ATA_ID_CFG_RESERVED1  0b0000000000000001
 #define ATA_ID_CFG_UNUSED3    0b0000000000000010
@@ -155,14 +246,17 @@ class io_device_ata_t : public io_device_t {
 #define CURRENT_DRIVE channel[index].drive[channel[index].drive_number]
 
     void store_identify_buffer() {
-        uint16_t id_buf[ATA_SECTOR_SIZE / 2];
+        uint16_t id_buf[ATA_SECTOR_SIZE / 2] = { 0 };
+
+        uint64_t sectors = CURRENT_DRIVE.blk.size();
+        uint32_t sectors28 = (sectors > 0x0fffffff) ? 0x0fffffff : sectors;
 
         id_buf[0] = ATA_ID_CFG_FIXED; // Fixed, non-removable, ATA device
         id_buf[1] = 65535; // logical cylinders
         id_buf[3] = 16; // logical heads
         id_buf[6] = 63; // sectors per track
         id_buf[22] = 4; // number of bytes available in READ/WRITE LONG cmds
-        id_buf[47] = 0; // read-write multipe commands not implemented
+        id_buf[47] = 0x8000 | ATA_MAX_MULTIPLE; // Max sectors per READ/WRITE MULTIPLE block
         id_buf[49] = (1 << 9); // Capabilities - LBA supported, DMA supported
         id_buf[50] = (1 << 14); // Capabilities - bit 14 needs to be set as required by ATA/ATAPI-5 spec
         id_buf[51] = (4 << 8); // PIO data transfer cycle timing mode
@@ -172,15 +266,23 @@ class io_device_ata_t : public io_device_t {
         id_buf[56] = 63; // sectors per track
         id_buf[57] = 0xffff;
         id_buf[58] = 0xffff;
-        id_buf[60] = 0xffff;
-        id_buf[61] = 0xffff;
+        id_buf[59] = CURRENT_DRIVE.multiple ? (0x100 | CURRENT_DRIVE.multiple) : 0; // Current multiple setting
+        id_buf[60] = sectors28 & 0xffff; // Addressable sectors (28-bit)
+        id_buf[61] = sectors28 >> 16;
+        id_buf[63] = 0x0007; // Multiword DMA modes 0-2 supported
         id_buf[64] = 0; // advanced PIO modes not supported
         id_buf[67] = 1; // PIO transfer cycle time without flow control
         id_buf[68] = 1; // PIO transfer cycle time with IORDY flow control
         id_buf[80] = 1 << 6; // ATA major version
+        id_buf[83] = (1 << 14) | (1 << 10); // 48-bit address feature set supported
+        id_buf[86] = (1 << 10); // 48-bit address feature set enabled
         id_buf[88] = 0; // UDMA mode 5 not supported
+        id_buf[100] = (sectors >> 0 ) & 0xffff; // Addressable sectors (48-bit)
+        id_buf[101] = (sectors >> 16) & 0xffff;
+        id_buf[102] = (sectors >> 32) & 0xffff;
+        id_buf[103] = 0;
 
-        char serial[20];
+        char serial[21];
 
         // Generate serial
         for (int i = 0; i < 20; i++)
@@ -192,38 +294,495 @@ class io_device_ata_t : public io_device_t {
         std::memcpy(&id_buf[23], "hyvmidec", 8);
         std::memcpy(&id_buf[27], "WDC WD4005FZBX-00K5WB0\0                ", 40);
 
-        std::memcpy(CURRENT_DRIVE.rw_buf, id_buf, ATA_SECTOR_SIZE);
+        CURRENT_DRIVE.rw_buf.resize(ATA_SECTOR_SIZE);
+
+        std::memcpy(CURRENT_DRIVE.rw_buf.data(), id_buf, ATA_SECTOR_SIZE);
 
         CURRENT_DRIVE.rw_pending_bytes = ATA_SECTOR_SIZE;
+        CURRENT_DRIVE.rw_index         = 0;
+        CURRENT_DRIVE.rw_block_bytes   = ATA_SECTOR_SIZE;
         CURRENT_DRIVE.rw_direction     = false;
     }
 
 #define RW_READ  0
 #define RW_WRITE 1
 
-    bool ata_check_access_and_channel(uint32_t port) {
-        // Figure out channel from port
-        if ((port >= pri_io_base) && (port <= (pri_io_base + ATA_IO_SIZE))) {
-            index = ATA_PRIMARY;            
+    /**
+     * @brief Select the channel a port belongs to and return
+     *        the ATA register it addresses
+     *
+     * @param port I/O port
+     * @return Register index (ATA_REG_*), or -1 if the port
+     *         isn't ours
+     */
+    int ata_decode_port(uint32_t port) {
+        if ((uint32_t)(port - pri_io_base) < ATA_IO_SIZE) {
+            index = ATA_PRIMARY;
+
+            return port - pri_io_base;
+        } else if ((uint32_t)(port - sec_io_base) < ATA_IO_SIZE) {
+            index = ATA_SECONDARY;
+
+            return port - sec_io_base;
+        } else if ((uint32_t)(port - pri_ctrl_base) < ATA_CTRL_SIZE) {
+            index = ATA_PRIMARY;
 
-            return true;
-        } else if ((port >= sec_io_base) && (port <= (sec_io_base + ATA_IO_SIZE))) {
+            return ATA_REG_CONTROL + (port - pri_ctrl_base);
+        } else if ((uint32_t)(port - sec_ctrl_base) < ATA_CTRL_SIZE) {
             index = ATA_SECONDARY;
 
-            return true;
+            return ATA_REG_CONTROL + (port - sec_ctrl_base);
+        } else if ((uint32_t)(port - bm_base) < ATA_BM_SIZE) {
+            index = ((port - bm_base) >= 8) ? ATA_SECONDARY : ATA_PRIMARY;
+
+            return ATA_REG_BM + ((port - bm_base) & 0x7);
+        }
+
+        return -1;
+    }
+
+    void build_port_list() {
+        ports.clear();
+
+        for (int i = 0; i < ATA_IO_SIZE; i++) {
+            ports.push_back(pri_io_base + i);
+            ports.push_back(sec_io_base + i);
         }
 
-        return false;
+        for (int i = 0; i < ATA_CTRL_SIZE; i++) {
+            ports.push_back(pri_ctrl_base + i);
+            ports.push_back(sec_ctrl_base + i);
+        }
+
+        for (int i = 0; i < ATA_BM_SIZE; i++)
+            ports.push_back(bm_base + i);
     }
 
     uint32_t data = 0x0;
 
+    uint64_t ata_get_lba(bool ext) {
+        ata_channel_t& ch = CURRENT_CHANNEL;
+
+        if (ext) {
+            return ((uint64_t)ch.lba[0] << 0 ) | ((uint64_t)ch.lba[1] << 8 ) |
+                   ((uint64_t)ch.lba[2] << 16) | ((uint64_t)ch.lba[3] << 24) |
+                   ((uint64_t)ch.lba[4] << 32) | ((uint64_t)ch.lba[5] << 40);
+        }
+
+        return (ch.lba[0] << 0) | (ch.lba[1] << 8) | (ch.lba[2] << 16) |
+               ((ch.hddevsel & 0xf) << 24);
+    }
+
+    uint32_t ata_get_count(bool ext) {
+        ata_channel_t& ch = CURRENT_CHANNEL;
+
+        if (ext) {
+            uint32_t count = ch.seccount[0] | (ch.seccount[1] << 8);
+
+            return count ? count : 0x10000;
+        }
+
+        return ch.seccount[0] ? ch.seccount[0] : 0x100;
+    }
+
+    void ata_io_handle_taskfile(int reg, bool rw) {
+        ata_channel_t& ch = CURRENT_CHANNEL;
+
+        if (rw == RW_READ) {
+            switch (reg) {
+                case ATA_REG_ERROR    : data = CURRENT_DRIVE.error; break;
+                case ATA_REG_SECCOUNT0: data = ch.seccount[0]; break;
+                case ATA_REG_LBA0     : data = ch.lba[0]; break;
+                case ATA_REG_LBA1     : data = ch.lba[1]; break;
+                case ATA_REG_LBA2     : data = ch.lba[2]; break;
+                case ATA_REG_SECCOUNT1: data = ch.seccount[1]; break;
+                case ATA_REG_LBA3     : data = ch.lba[3]; break;
+                case ATA_REG_LBA4     : data = ch.lba[4]; break;
+                case ATA_REG_LBA5     : data = ch.lba[5]; break;
+                case ATA_REG_ALTSTATUS: data = CURRENT_DRIVE.status; break;
+            }
+
+            return;
+        }
+
+        // Writing the low registers pushes the previous value
+        // into the HOB half
+        switch (reg) {
+            case ATA_REG_FEATURES : ch.features = data; break;
+            case ATA_REG_SECCOUNT0: ch.seccount[1] = ch.seccount[0]; ch.seccount[0] = data; break;
+            case ATA_REG_LBA0     : ch.lba[3] = ch.lba[0]; ch.lba[0] = data; break;
+            case ATA_REG_LBA1     : ch.lba[4] = ch.lba[1]; ch.lba[1] = data; break;
+            case ATA_REG_LBA2     : ch.lba[5] = ch.lba[2]; ch.lba[2] = data; break;
+            case ATA_REG_SECCOUNT1: ch.seccount[1] = data; break;
+            case ATA_REG_LBA3     : ch.lba[3] = data; break;
+            case ATA_REG_LBA4     : ch.lba[4] = data; break;
+            case ATA_REG_LBA5     : ch.lba[5] = data; break;
+            case ATA_REG_CONTROL  : ch.control = data; break;
+        }
+    }
+
+    void ata_raise_irq(int ch) {
+        if (channel[ch].control & ATA_CTRL_NIEN)
+            return;
+
+        if (pic)
+            pic->raise(PIC_LINE_ATA);
+    }
+
+    void ata_command_abort(int ch, ata_channel_t::drive_t& drv) {
+        drv.status = ATA_SR_DRDY | ATA_SR_ERR;
+        drv.error  = ATA_ER_ABRT;
+
+        ata_raise_irq(ch);
+    }
+
+    static void ata_io_job(void* udata) {
+        ata_job_t* job = (ata_job_t*)udata;
+
+        job->ata->ata_run_io(job->ata->channel[job->ch].drive[job->drv]);
+    }
+
+    /**
+     * @brief Hand the current drive's backing-store operation to the
+     *        worker pool
+     *
+     * The drive reports BSY until complete_io() picks up the result,
+     * the guest keeps executing in the meantime.
+     */
+    void ata_submit_io(int op) {
+        CURRENT_DRIVE.io_op  = op;
+        CURRENT_DRIVE.status = ATA_SR_BSY;
+
+        workers.submit(ata_io_job, &jobs[(index * 2) + CURRENT_CHANNEL.drive_number]);
+    }
+
+    // Called from a worker thread, must only touch the drive's own
+    // buffers and block device
+    void ata_run_io(ata_channel_t::drive_t& drv) {
+        bool ok = false;
+
+        switch (drv.io_op) {
+            case ATA_IO_READ: {
+                ok = drv.blk.read(drv.rw_base_lba, drv.rw_sectors, drv.rw_buf.data());
+            } break;
+
+            case ATA_IO_WRITE: {
+                ok = drv.blk.write(drv.rw_base_lba, drv.rw_buf.data(), drv.rw_index);
+            } break;
+
+            case ATA_IO_FLUSH: {
+                ok = drv.blk.flush();
+            } break;
+
+            case ATA_IO_DMA: {
+                ok = ata_dma_transfer(drv);
+            } break;
+        }
+
+        drv.io_ok = ok;
+        drv.io_done.store(true, std::memory_order_release);
+
+        completions.fetch_add(1, std::memory_order_release);
+
+        if (cpu && cpu->sched)
+            hv2_sched_notify(cpu->sched);
+    }
+
+    // Update taskfile and bus master state once a worker is done,
+    // runs on the emulation thread
+    void ata_finish_io(int ch, ata_channel_t::drive_t& drv) {
+        if (drv.io_op == ATA_IO_DMA) {
+            channel[ch].bm_status &= ~ATA_BM_SR_ACTIVE;
+            channel[ch].bm_status |= ATA_BM_SR_IRQ | (drv.io_ok ? 0 : ATA_BM_SR_ERR);
+        }
+
+        if (!drv.io_ok) {
+            drv.rw_pending_bytes = 0;
+
+            ata_command_abort(ch, drv);
+
+            return;
+        }
+
+        drv.error  = 0x0;
+        drv.status = ATA_SR_DRDY;
+
+        // PIO reads can now be drained through the data port
+        if (drv.io_op == ATA_IO_READ) {
+            drv.rw_pending_bytes = (size_t)drv.rw_sectors * ATA_SECTOR_SIZE;
+            drv.status |= ATA_SR_DRQ;
+        }
+
+        ata_raise_irq(ch);
+    }
+
+    /**
+     * @brief Resolve the channel's PRD table into host pointers
+     *
+     * Runs on the emulation thread when the bus master is started, so
+     * the worker can then memcpy straight between the image mapping
+     * and guest RAM.
+     *
+     * @return false if the PRD table didn't cover the whole transfer
+     *         or a region isn't backed by guest RAM
+     */
+    bool ata_dma_build_segments() {
+        ata_channel_t& ch = CURRENT_CHANNEL;
+        ata_channel_t::drive_t& drv = CURRENT_DRIVE;
+
+        uint64_t bytes = (uint64_t)drv.rw_sectors * ATA_SECTOR_SIZE;
+        uint32_t prd = ch.bm_prdt;
+
+        drv.dma_segments.clear();
+
+        while (bytes) {
+            uint32_t entry[2];
+
+            if (!hv2_mmu_dma_read(cpu, prd, entry, sizeof(entry)))
+                return false;
+
+            uint32_t addr = entry[0] & 0xfffffffe;
+            uint32_t size = entry[1] & 0xfffe;
+            bool eot = (entry[1] >> 16) & ATA_PRD_EOT;
+
+            // A byte count of 0 means 64 KiB
+            if (!size)
+                size = 0x10000;
+
+            if (size > bytes)
+                size = bytes;
+
+            uint8_t* ptr = hv2_mmu_get_dma_ptr(cpu, addr, size);
+
+            if (!ptr)
+                return false;
+
+            drv.dma_segments.push_back({ ptr, size });
+
+            bytes -= size;
+            prd += 8;
+
+            if (eot)
+                break;
+        }
+
+        return !bytes;
+    }
+
+    bool ata_dma_transfer(ata_channel_t::drive_t& drv) {
+        uint8_t* disk = drv.blk.get_sector_ptr(drv.rw_base_lba, drv.rw_sectors);
+
+        // Backends that can't be mapped (i.e. overlays) go through
+        // rw_buf, read or written as a single run
+        bool bounce = !disk;
+
+        if (bounce) {
+            drv.rw_buf.resize((size_t)drv.rw_sectors * ATA_SECTOR_SIZE);
+
+            disk = drv.rw_buf.data();
+
+            if (drv.dma_direction == RW_READ)
+                if (!drv.blk.read(drv.rw_base_lba, drv.rw_sectors, disk))
+                    return false;
+        }
+
+        uint8_t* ptr = disk;
+
+        for (const ata_dma_segment_t& seg : drv.dma_segments) {
+            if (drv.dma_direction == RW_READ) {
+                std::memcpy(seg.ptr, ptr, seg.size);
+            } else {
+                std::memcpy(ptr, seg.ptr, seg.size);
+            }
+
+            ptr += seg.size;
+        }
+
+        if (bounce && (drv.dma_direction == RW_WRITE))
+            return drv.blk.write(drv.rw_base_lba, disk, drv.rw_buf.size());
+
+        return true;
+    }
+
+    // Run a pending DMA command once the bus master has been started
+    void ata_dma_try_start() {
+        ata_channel_t& ch = CURRENT_CHANNEL;
+
+        if (!(ch.bm_command & ATA_BM_CMD_START))
+            return;
+
+        ata_channel_t::drive_t& drv = CURRENT_DRIVE;
+
+        if (!drv.dma_pending)
+            return;
+
+        drv.dma_pending = false;
+
+        if (!ata_dma_build_segments()) {
+            ch.bm_status &= ~ATA_BM_SR_ACTIVE;
+            ch.bm_status |= ATA_BM_SR_IRQ | ATA_BM_SR_ERR;
+
+            ata_command_abort(index, drv);
+
+            return;
+        }
+
+        ata_submit_io(ATA_IO_DMA);
+    }
+
+    void ata_dma_setup(bool ext, bool direction) {
+        ata_channel_t::drive_t& drv = CURRENT_DRIVE;
+
+        if (!drv.blk.is_open()) {
+            drv.status = 0x0;
+
+            return;
+        }
+
+        drv.rw_base_lba   = ata_get_lba(ext);
+        drv.rw_sectors    = ata_get_count(ext);
+        drv.dma_direction = direction;
+
+        if (!drv.blk.in_range(drv.rw_base_lba, drv.rw_sectors)) {
+            drv.error  = ATA_ER_IDNF;
+            drv.status = ATA_SR_DRDY | ATA_SR_ERR;
+
+            ata_raise_irq(index);
+
+            return;
+        }
+
+        drv.dma_pending = true;
+        drv.status      = ATA_SR_DRDY | ATA_SR_BSY;
+
+        ata_dma_try_start();
+    }
+
+    void ata_io_handle_bm(int reg, bool rw, int size) {
+        ata_channel_t& ch = CURRENT_CHANNEL;
+
+        if (rw == RW_READ) {
+            switch (reg) {
+                case ATA_BM_REG_COMMAND: data = ch.bm_command; break;
+                case ATA_BM_REG_STATUS : data = ch.bm_status; break;
+                case ATA_BM_REG_PRDT   : data = ch.bm_prdt; break;
+                default: data = 0; break;
+            }
+
+            return;
+        }
+
+        switch (reg) {
+            case ATA_BM_REG_COMMAND: {
+                ch.bm_command = data & (ATA_BM_CMD_START | ATA_BM_CMD_READ);
+
+                if (ch.bm_command & ATA_BM_CMD_START) {
+                    ch.bm_status |= ATA_BM_SR_ACTIVE;
+
+                    ata_dma_try_start();
+                } else {
+                    ch.bm_status &= ~ATA_BM_SR_ACTIVE;
+                }
+            } break;
+
+            case ATA_BM_REG_STATUS: {
+                // IRQ and ERR are write 1 to clear, drive DMA
+                // capability bits are plain R/W
+                ch.bm_status &= ~(data & (ATA_BM_SR_IRQ | ATA_BM_SR_ERR));
+                ch.bm_status = (ch.bm_status & ~(ATA_BM_SR_DRV0_DMA | ATA_BM_SR_DRV1_DMA)) |
+                               (data & (ATA_BM_SR_DRV0_DMA | ATA_BM_SR_DRV1_DMA));
+            } break;
+
+            case ATA_BM_REG_PRDT: {
+                ch.bm_prdt = data & 0xfffffffc;
+            } break;
+        }
+    }
+
+    /**
+     * @brief Start a PIO READ/WRITE SECTORS or READ/WRITE MULTIPLE
+     *        command
+     *
+     * The whole sector run goes through rw_buf: reads fetch it from
+     * the block device in one go before raising DRQ, writes are
+     * committed with a single write once the last word arrives.
+     *
+     * @param ext 48-bit LBA command
+     * @param direction RW_READ or RW_WRITE
+     * @param multiple READ/WRITE MULTIPLE (one IRQ per block)
+     */
+    void ata_pio_setup(bool ext, bool direction, bool multiple) {
+        ata_channel_t::drive_t& drv = CURRENT_DRIVE;
+
+        if (!drv.blk.is_open()) {
+            drv.status = 0x0;
+
+            return;
+        }
+
+        if (multiple && !drv.multiple) {
+            ata_command_abort(index, drv);
+
+            return;
+        }
+
+        drv.rw_base_lba = ata_get_lba(ext);
+        drv.rw_sectors  = ata_get_count(ext);
+
+        if (!drv.blk.in_range(drv.rw_base_lba, drv.rw_sectors)) {
+            drv.error  = ATA_ER_IDNF;
+            drv.status = ATA_SR_DRDY | ATA_SR_ERR;
+
+            ata_raise_irq(index);
+
+            return;
+        }
+
+        size_t bytes = (size_t)drv.rw_sectors * ATA_SECTOR_SIZE;
+
+        drv.rw_buf.resize(bytes);
+
+        drv.rw_index         = 0;
+        drv.rw_block_bytes   = (multiple ? drv.multiple : 1) * ATA_SECTOR_SIZE;
+        drv.rw_direction     = direction;
+        drv.error            = 0x0;
+
+        if (direction == RW_READ) {
+            // DRQ is raised once the worker has the whole run
+            drv.rw_pending_bytes = 0;
+
+            ata_submit_io(ATA_IO_READ);
+        } else {
+            // The first block is requested without an interrupt
+            drv.rw_pending_bytes = bytes;
+            drv.status = ATA_SR_DRDY | ATA_SR_DRQ;
+        }
+    }
+
+    void ata_set_multiple() {
+        uint8_t count = CURRENT_CHANNEL.seccount[0];
+
+        // Only powers of 2 up to ATA_MAX_MULTIPLE, 0 disables
+        if ((count > ATA_MAX_MULTIPLE) || (count & (count - 1))) {
+            ata_command_abort(index, CURRENT_DRIVE);
+
+            return;
+        }
+
+        CURRENT_DRIVE.multiple = count;
+        CURRENT_DRIVE.status   = ATA_SR_DRDY;
+        CURRENT_DRIVE.error    = 0x0;
+
+        ata_raise_irq(index);
+    }
+
     void ata_io_handle_hddevsel(bool rw) {
         if (!rw) {
-            data = 0xe0 | (CURRENT_CHANNEL.drive_number << 4);
+            data = 0xe0 | (CURRENT_CHANNEL.drive_number << 4) | (CURRENT_CHANNEL.hddevsel & 0xf);
 
             return;
         } else {
+            CURRENT_CHANNEL.hddevsel = data;
             CURRENT_CHANNEL.drive_number = (data >> 4) & 0x1;
 
             return;
@@ -236,9 +795,35 @@ class io_device_ata_t : public io_device_t {
 
             return;
         } else {
+            // Commands are ignored while the drive is busy
+            if (CURRENT_DRIVE.status & ATA_SR_BSY)
+                return;
+
             switch (data) {
-                case ATA_CMD_READ_PIO: {
+                case ATA_CMD_READ_PIO          : ata_pio_setup(false, RW_READ , false); break;
+                case ATA_CMD_READ_PIO_EXT      : ata_pio_setup(true , RW_READ , false); break;
+                case ATA_CMD_WRITE_PIO         : ata_pio_setup(false, RW_WRITE, false); break;
+                case ATA_CMD_WRITE_PIO_EXT     : ata_pio_setup(true , RW_WRITE, false); break;
+                case ATA_CMD_READ_MULTIPLE     : ata_pio_setup(false, RW_READ , true ); break;
+                case ATA_CMD_READ_MULTIPLE_EXT : ata_pio_setup(true , RW_READ , true ); break;
+                case ATA_CMD_WRITE_MULTIPLE    : ata_pio_setup(false, RW_WRITE, true ); break;
+                case ATA_CMD_WRITE_MULTIPLE_EXT: ata_pio_setup(true , RW_WRITE, true ); break;
+                case ATA_CMD_SET_MULTIPLE      : ata_set_multiple(); break;
+
+                case ATA_CMD_READ_DMA    : ata_dma_setup(false, RW_READ ); break;
+                case ATA_CMD_READ_DMA_EXT: ata_dma_setup(true , RW_READ ); break;
+                case ATA_CMD_WRITE_DMA    : ata_dma_setup(false, RW_WRITE); break;
+                case ATA_CMD_WRITE_DMA_EXT: ata_dma_setup(true , RW_WRITE); break;
+
+                case ATA_CMD_CACHE_FLUSH:
+                case ATA_CMD_CACHE_FLUSH_EXT: {
+                    if (!CURRENT_DRIVE.blk.is_open()) {
+                        CURRENT_DRIVE.status = 0x0;
+
+                        break;
+                    }
 
+                    ata_submit_io(ATA_IO_FLUSH);
                 } break;
 
                 case ATA_CMD_IDENTIFY: {
@@ -266,59 +851,79 @@ class io_device_ata_t : public io_device_t {
     }
 
     void ata_io_handle_data(bool rw, int size) {
-        if (!CURRENT_DRIVE.rw_pending_bytes) return;
+        ata_channel_t::drive_t& drv = CURRENT_DRIVE;
 
-        uint32_t data = 0x0;
+        if (!drv.rw_pending_bytes) return;
 
-        switch (rw) {
-            case RW_READ: {
-                if (CURRENT_DRIVE.rw_direction != RW_READ) {
-                    // Attempted reading from ATA_REG_DATA during a write
-                    // operation
+        // Attempted reading from ATA_REG_DATA during a write
+        // operation, or the other way around
+        if (drv.rw_direction != rw) return;
 
-                    return;
-                }
-                
-                int rw_index = ATA_SECTOR_SIZE - CURRENT_DRIVE.rw_pending_bytes;
+        size_t bytes = (size == HV2_BYTE) ? 1 : ((size == HV2_SHORT) ? 2 : 4);
 
-                switch (size) {
-                    case 0: {
-                        data = CURRENT_DRIVE.rw_buf[rw_index];
+        if (bytes > drv.rw_pending_bytes)
+            bytes = drv.rw_pending_bytes;
 
-                        CURRENT_DRIVE.rw_pending_bytes -= 1;
-                    } break;
+        uint8_t* ptr = &drv.rw_buf[drv.rw_index];
 
-                    case 1: {
-                        data = *(uint16_t*)(&CURRENT_DRIVE.rw_buf[rw_index]);
+        if (rw == RW_READ) {
+            data = 0;
 
-                        CURRENT_DRIVE.rw_pending_bytes -= 2;
-                    } break;
+            std::memcpy(&data, ptr, bytes);
+        } else {
+            std::memcpy(ptr, &data, bytes);
+        }
 
-                    case 2: default: {
-                        data = *(uint32_t*)(&CURRENT_DRIVE.rw_buf[rw_index]);
+        drv.rw_index += bytes;
+        drv.rw_pending_bytes -= bytes;
 
-                        CURRENT_DRIVE.rw_pending_bytes -= 4;
-                    }
-                }
-            } break;
+        if (!drv.rw_pending_bytes) {
+            drv.status = ATA_SR_DRDY;
 
-            case RW_WRITE: {
-                // To-do
-            } break;
+            // Commit the whole run with a single write
+            if (rw == RW_WRITE)
+                ata_submit_io(ATA_IO_WRITE);
+
+            return;
         }
+
+        // Next DRQ block ready (read) or accepted (write)
+        if (!(drv.rw_index % drv.rw_block_bytes))
+            ata_raise_irq(index);
     }
 
 public:
-    bool attach_drive(const std::string& path, int attachment) {
+    // Finish in-flight I/O and write cached sectors back, the
+    // controller can't be used afterwards
+    void shutdown() {
+        workers.stop();
+
+        for (int i = 0; i < 4; i++)
+            get_drive(i)->blk.flush();
+    }
+
+    ata_channel_t::drive_t* get_drive(int attachment) {
         switch (attachment) {
-            case ATA_PRI_MASTER: return channel[ATA_PRIMARY].drive[ATA_MASTER].blk.open(path, ATA_SECTOR_SIZE);
-            case ATA_PRI_SLAVE : return channel[ATA_PRIMARY].drive[ATA_SLAVE].blk.open(path, ATA_SECTOR_SIZE);
-            case ATA_SEC_MASTER: return channel[ATA_SECONDARY].drive[ATA_MASTER].blk.open(path, ATA_SECTOR_SIZE);
-            case ATA_SEC_SLAVE : return channel[ATA_SECONDARY].drive[ATA_SLAVE].blk.open(path, ATA_SECTOR_SIZE);
-            default: return false;
+            case ATA_PRI_MASTER: return &channel[ATA_PRIMARY].drive[ATA_MASTER];
+            case ATA_PRI_SLAVE : return &channel[ATA_PRIMARY].drive[ATA_SLAVE];
+            case ATA_SEC_MASTER: return &channel[ATA_SECONDARY].drive[ATA_MASTER];
+            case ATA_SEC_SLAVE : return &channel[ATA_SECONDARY].drive[ATA_SLAVE];
         }
 
-        return false;
+        return nullptr;
+    }
+
+    bool attach_drive(const std::string& path, int attachment) {
+        ata_channel_t::drive_t* drv = get_drive(attachment);
+
+        return drv && drv->blk.open(path, ATA_SECTOR_SIZE);
+    }
+
+    // Guest writes land in the overlay, the base image stays untouched
+    bool attach_overlay(const std::string& path, const std::string& base, int attachment) {
+        ata_channel_t::drive_t* drv = get_drive(attachment);
+
+        return drv && drv->blk.open_overlay(path, base, ATA_SECTOR_SIZE);
     }
 
     void redefine_ports(
@@ -327,15 +932,15 @@ public:
         uint16_t sec_io_base   = ATA_SEC_IO,
         uint16_t sec_ctrl_base = ATA_SEC_CTRL) {
         
-        pri_io_base   = pri_io_base;
-        pri_ctrl_base = pri_ctrl_base;
-        sec_io_base   = sec_io_base;
-        sec_ctrl_base = sec_ctrl_base;
+        this->pri_io_base   = pri_io_base;
+        this->pri_ctrl_base = pri_ctrl_base;
+        this->sec_io_base   = sec_io_base;
+        this->sec_ctrl_base = sec_ctrl_base;
+
+        build_port_list();
 
-        ports[0] = pri_io_base;
-        ports[1] = pri_ctrl_base;
-        ports[2] = sec_io_base;
-        ports[3] = sec_ctrl_base;
+        if (io)
+            io->rebuild_port_map();
 
         // Update PCI BAR data
         desc.bar[0] = PCI_BAR_IO | (pri_io_base   << 2); // Primary Channel IO
@@ -344,12 +949,8 @@ public:
         desc.bar[3] = PCI_BAR_IO | (sec_ctrl_base << 2); // Secondary Channel CTRL
     }
 
-    io_device_port_list_t ports = {
-        pri_io_base,
-        pri_ctrl_base,
-        sec_io_base,
-        sec_ctrl_base
-    };
+    // Every port in both channels' IO and CTRL windows
+    io_device_port_list_t ports;
 
     io_device_port_list_t* get_port_list() {
         return &ports;
@@ -373,16 +974,48 @@ public:
             PCI_IO_BAR(pri_ctrl_base), // Primary Channel CTRL
             PCI_IO_BAR(sec_io_base  ), // Secondary Channel IO
             PCI_IO_BAR(sec_ctrl_base), // Secondary Channel CTRL
+            PCI_IO_BAR(bm_base      ), // Bus Master IDE
             0x00000000,
-            0x00000000
+            // BAR sizes:
+            { 0x10, 0x4, 0x10, 0x4, ATA_BM_SIZE, 0 }
         };
     }
 
-    void init() {
+    // Cheap enough to check after every instruction
+    bool has_completions() {
+        return completions.load(std::memory_order_acquire);
+    }
+
+    // Apply the results of finished backing-store operations
+    void complete_io() {
+        completions.store(0, std::memory_order_relaxed);
+
+        for (int ch = 0; ch < 2; ch++) {
+            for (int d = 0; d < 2; d++) {
+                ata_channel_t::drive_t& drv = channel[ch].drive[d];
+
+                if (drv.io_done.exchange(false, std::memory_order_acquire))
+                    ata_finish_io(ch, drv);
+            }
+        }
+    }
+
+    void init(hv2_t* cpu, io_device_pic_t* pic) {
+        this->cpu = cpu;
+        this->pic = pic;
+
+        for (int i = 0; i < 4; i++)
+            jobs[i] = { this, i >> 1, i & 1 };
+
+        workers.init(ATA_WORKERS);
+
         pri_io_base   = ATA_PRI_IO;
         pri_ctrl_base = ATA_PRI_CTRL;
         sec_io_base   = ATA_SEC_IO;
         sec_ctrl_base = ATA_SEC_CTRL;
+        bm_base       = ATA_BM_BASE;
+
+        build_port_list();
 
         // Initialize PCI desc structure
         desc.devid    = 0x0000;
@@ -401,16 +1034,21 @@ public:
         desc.bar[1]   = PCI_BAR_IO | (pri_ctrl_base << 2); // Primary Channel CTRL
         desc.bar[2]   = PCI_BAR_IO | (sec_io_base   << 2); // Secondary Channel IO
         desc.bar[3]   = PCI_BAR_IO | (sec_ctrl_base << 2); // Secondary Channel CTRL
+        desc.bar[4]   = PCI_IO_BAR(bm_base);                 // Bus Master IDE
     }
 
     uint32_t read(uint32_t port, int size) override {
-        switch (port & 0xf) {
-            case ATA_REG_DATA: {
-                ata_io_handle_data(RW_READ, size);
-            } break;
+        int reg = ata_decode_port(port);
+
+        if (reg >= ATA_REG_BM) {
+            ata_io_handle_bm(reg - ATA_REG_BM, RW_READ, size);
 
-            case ATA_REG_ERROR: { // for R, ATA_REG_FEATURES for W
+            return data;
+        }
 
+        switch (reg) {
+            case ATA_REG_DATA: {
+                ata_io_handle_data(RW_READ, size);
             } break;
 
             case ATA_REG_HDDEVSEL: {
@@ -420,19 +1058,29 @@ public:
             case ATA_REG_COMMAND: { // for W, ATA_REG_STATUS for R
                 ata_io_handle_command(RW_READ);
             } break;
+
+            default: {
+                ata_io_handle_taskfile(reg, RW_READ);
+            } break;
         }
 
         return data;
     }
 
     void write(uint32_t port, uint32_t value, int size) override {
-        switch (port & 0xf) {
-            case ATA_REG_DATA: {
-                ata_io_handle_data(RW_WRITE, size);
-            } break;
+        data = value;
 
-            case ATA_REG_ERROR: { // for R, ATA_REG_FEATURES for W
+        int reg = ata_decode_port(port);
 
+        if (reg >= ATA_REG_BM) {
+            ata_io_handle_bm(reg - ATA_REG_BM, RW_WRITE, size);
+
+            return;
+        }
+
+        switch (reg) {
+            case ATA_REG_DATA: {
+                ata_io_handle_data(RW_WRITE, size);
             } break;
 
             case ATA_REG_HDDEVSEL: {
@@ -442,6 +1090,10 @@ public:
             case ATA_REG_COMMAND: { // for W, ATA_REG_STATUS for R
                 ata_io_handle_command(RW_WRITE);
             } break;
+
+            default: {
+                ata_io_handle_taskfile(reg, RW_WRITE);
+            } break;
         }
     }
     // ATA has two buses, a "Primary" bus, and a "Secondary" bus
@@ -43,6 +43,13 @@ public:
         }
     }
 
+    uint8_t* get_dma_ptr(uint32_t addr, uint32_t size) override {
+        if ((addr < base) || (size > this->size) || ((addr - base) > (this->size - size)))
+            return nullptr;
+
+        return &buf[addr - base];
+    }
+
     void init(uint32_t base, uint32_t size) {
         this->base = base;
         this->size = size;
@@ -1,59 +1,210 @@
 #pragma once
 
-#include <fstream>
 #include <string>
-#include <cmath>
-
+#include <cstdint>
+#include <cstring>
+
+#include "block_backend.hpp"
+#include "block_raw.hpp"
+#include "block_overlay.hpp"
+#include "block_sparse.hpp"
+#include "block_cache.hpp"
+
+#define BLOCK_CACHE_DEFAULT_SIZE 0x800000
+
+/*
+    Sector-addressed front end for disk images. The image format
+    is detected when opening, raw images are memory-mapped, overlays
+    keep writes in a delta file on top of a read-only base and sparse
+    images only store (compressed) clusters that aren't all zeroes.
+
+    Backends that can't be mapped get a block_cache_t in front of
+    them, mapped images already go through the host's page cache.
+*/
 struct block_dev_t {
-    std::fstream m_file;
+    block_backend_t* m_backend = nullptr;
+    block_cache_t* m_cache = nullptr;
+
+    size_t m_cache_size = BLOCK_CACHE_DEFAULT_SIZE;
+
+    size_t   m_sector_size;
+    uint64_t m_sectors;
 
-    size_t m_sector_size;
-    size_t m_sectors;
-    size_t m_bytes;
+    bool m_read_only = false;
 
-    bool m_open = false;
+    ~block_dev_t() {
+        close();
+    }
 
-    bool open(std::string path, size_t m_sector_size) {
-        m_file.open(path, std::ios::in | std::ios::out | std::ios::binary | std::ios::ate);
+    /**
+     * @brief Open a disk image, detecting its format
+     *
+     * @param path Image file
+     * @param m_sector_size Sector size in bytes
+     * @param read_only Don't take write access to the image, writes fail
+     * @return true on success
+     */
+    bool open(std::string path, size_t m_sector_size, bool read_only = false) {
+        close();
 
         this->m_sector_size = m_sector_size;
+        this->m_read_only = read_only;
 
-        if ((!m_file.is_open()) || (!m_file.good())) {
-            // _log(error, "Couldn't open file %s (%u, %u)", path.c_str(), file.is_open(), file.good());
+        if (block_overlay_t::probe(path)) {
+            block_overlay_t* overlay = new block_overlay_t;
 
-            m_open = false;
+            if (!overlay->open(path, read_only)) {
+                delete overlay;
 
-            return false;
+                return false;
+            }
+
+            m_backend = overlay;
+        } else if (block_sparse_t::probe(path)) {
+            block_sparse_t* sparse = new block_sparse_t;
+
+            if (!sparse->open(path, read_only)) {
+                delete sparse;
+
+                return false;
+            }
+
+            m_backend = sparse;
+        } else {
+            block_raw_t* raw = new block_raw_t;
+
+            if (!raw->open(path, read_only)) {
+                delete raw;
+
+                return false;
+            }
+
+            m_backend = raw;
         }
 
-        m_bytes = m_file.tellg();
-        m_sectors = m_bytes / m_sector_size;
+        m_sectors = m_backend->size() / m_sector_size;
 
-        m_file.seekg(0);
-        
-        m_open = true;
+        set_cache(m_cache_size);
 
         return true;
     }
 
+    /**
+     * @brief Set the size of the sector cache, dirty sectors are
+     *        written back before resizing
+     *
+     * @param size Cache size in bytes, 0 disables caching
+     */
+    void set_cache(size_t size) {
+        m_cache_size = size;
+
+        if (!m_backend)
+            return;
+
+        delete m_cache;
+
+        m_cache = nullptr;
+
+        if (!size || m_backend->map(0, m_sector_size))
+            return;
+
+        m_cache = new block_cache_t;
+        m_cache->init(m_backend, size);
+    }
+
+    bool is_cached() const {
+        return m_cache != nullptr;
+    }
+
+    block_cache_stats_t get_cache_stats() const {
+        return m_cache ? m_cache->get_stats() : block_cache_stats_t { 0 };
+    }
+
+    /**
+     * @brief Open a copy-on-write overlay, creating it on top of
+     *        a base image if it doesn't exist yet
+     *
+     * @param path Overlay (delta) file
+     * @param base Base image, only used when creating the overlay
+     * @param m_sector_size Sector size in bytes
+     * @return true on success
+     */
+    bool open_overlay(std::string path, std::string base, size_t m_sector_size) {
+        if (!block_overlay_t::probe(path))
+            if (!block_overlay_t::create(path, base))
+                return false;
+
+        return open(path, m_sector_size);
+    }
+
+    void close() {
+        // Write back dirty sectors before the backend goes away
+        delete m_cache;
+        delete m_backend;
+
+        m_cache = nullptr;
+
+        m_backend = nullptr;
+        m_sectors = 0;
+    }
+
     bool is_open() {
-        return m_open;
+        return m_backend != nullptr;
     }
 
-    size_t size() const { return m_sectors; }
+    uint64_t size() const { return m_sectors; }
 
-    void read(int sector, int count, void* data) {
-        m_file.seekg(sector * m_sector_size);
-        m_file.read((char*)data, count * m_sector_size);
+    bool in_range(uint64_t sector, uint64_t count) const {
+        return m_backend && (sector <= m_sectors) && (count <= (m_sectors - sector));
     }
 
-    void write(int sector, void* data, size_t size) {
-        m_file.seekg(sector * m_sector_size);
-        m_file.write((char*)data, size);
+    /**
+     * @brief Get a pointer to a run of sectors inside the image,
+     *        lets callers transfer data without an intermediate buffer
+     *
+     * @param sector First sector
+     * @param count Sector count
+     * @return Pointer to the first sector, nullptr if the run
+     *         is out of bounds or the backend isn't mapped
+     */
+    uint8_t* get_sector_ptr(uint64_t sector, uint64_t count) {
+        if (!in_range(sector, count))
+            return nullptr;
+
+        return m_backend->map(sector * m_sector_size, count * m_sector_size);
+    }
 
-        // Align back to sector boundary
-        size_t write_m_sectors = std::ceil((double)size / m_sector_size);
+    bool read(uint64_t sector, uint64_t count, void* data) {
+        if (!in_range(sector, count))
+            return false;
 
-        m_file.seekg((sector + write_m_sectors) * m_sector_size);
+        if (m_cache)
+            return m_cache->read(sector * m_sector_size, data, count * m_sector_size);
+
+        return m_backend->read(sector * m_sector_size, data, count * m_sector_size);
+    }
+
+    bool write(uint64_t sector, const void* data, size_t size) {
+        uint64_t count = (size + m_sector_size - 1) / m_sector_size;
+
+        // Checked here too, the cache would accept the write and only
+        // fail when writing it back
+        if (m_read_only || !in_range(sector, count))
+            return false;
+
+        if (m_cache)
+            return m_cache->write(sector * m_sector_size, data, size);
+
+        return m_backend->write(sector * m_sector_size, data, size);
+    }
+
+    bool flush() {
+        if (m_cache)
+            return m_cache->flush();
+
+        if (m_backend)
+            m_backend->flush();
+
+        return true;
     }
-};
\ No newline at end of file
+};
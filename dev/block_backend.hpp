@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+/*
+    Storage behind a block_dev_t. Offsets and sizes are in bytes,
+    block_dev_t takes care of sector addressing and bounds checking.
+*/
+class block_backend_t {
+public:
+    virtual ~block_backend_t() {};
+    virtual uint64_t size() = 0;
+    virtual bool read(uint64_t, void*, size_t) = 0;
+    virtual bool write(uint64_t, const void*, size_t) = 0;
+    virtual void flush() = 0;
+
+    // Direct pointer into the image for backends that can provide
+    // one (i.e. memory-mapped raw images), nullptr otherwise
+    virtual uint8_t* map(uint64_t, size_t) { return nullptr; };
+};
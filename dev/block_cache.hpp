@@ -0,0 +1,295 @@
+#pragma once
+
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+#include <list>
+#include <cstdint>
+#include <cstring>
+
+#include "block_backend.hpp"
+
+#define BLOCK_CACHE_LINE_SIZE 0x1000
+#define BLOCK_CACHE_READAHEAD 16    // Lines fetched ahead of a sequential stream
+#define BLOCK_CACHE_SEQ_THRESHOLD 2 // Back-to-back accesses before readahead kicks in
+
+struct block_cache_stats_t {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t readahead;
+    uint64_t writebacks;
+};
+
+/*
+    LRU write-back cache of fixed-size lines in front of a backend.
+    Misses on contiguous lines are fetched with a single backend read,
+    and streams of sequential reads prefetch the lines after them.
+    Dirty lines only reach the backend when evicted or on flush().
+*/
+class block_cache_t {
+    struct line_t {
+        uint64_t tag;
+        bool dirty;
+        std::vector <uint8_t> data;
+    };
+
+    block_backend_t* m_backend = nullptr;
+
+    std::list <line_t> m_lru;
+    std::unordered_map <uint64_t, std::list <line_t>::iterator> m_map;
+    std::vector <uint8_t> m_scratch;
+
+    size_t m_capacity = 0;
+    size_t m_readahead = 0;
+    uint64_t m_size = 0;
+    uint64_t m_lines = 0;
+
+    // Sequential access detection
+    uint64_t m_next = UINT64_MAX;
+    int m_streak = 0;
+
+    block_cache_stats_t m_stats = { 0 };
+
+    size_t valid_bytes(uint64_t tag) {
+        return std::min((uint64_t)BLOCK_CACHE_LINE_SIZE, m_size - (tag * BLOCK_CACHE_LINE_SIZE));
+    }
+
+    line_t* lookup(uint64_t tag) {
+        auto it = m_map.find(tag);
+
+        if (it == m_map.end())
+            return nullptr;
+
+        m_lru.splice(m_lru.begin(), m_lru, it->second);
+
+        return &*it->second;
+    }
+
+    bool writeback(line_t& line) {
+        if (!line.dirty)
+            return true;
+
+        m_stats.writebacks++;
+
+        // A line that failed to write stays dirty, so it isn't evicted
+        // and the next flush() retries it
+        if (!m_backend->write(line.tag * BLOCK_CACHE_LINE_SIZE, line.data.data(), valid_bytes(line.tag)))
+            return false;
+
+        line.dirty = false;
+
+        return true;
+    }
+
+    // Returns a line for tag, its contents are undefined
+    line_t* insert(uint64_t tag) {
+        if (m_lru.size() < m_capacity) {
+            m_lru.push_front({ tag, false, std::vector <uint8_t> (BLOCK_CACHE_LINE_SIZE) });
+        } else {
+            line_t& victim = m_lru.back();
+
+            if (!writeback(victim))
+                return nullptr;
+
+            m_map.erase(victim.tag);
+            m_lru.splice(m_lru.begin(), m_lru, std::prev(m_lru.end()));
+        }
+
+        line_t& line = m_lru.front();
+
+        line.tag = tag;
+        line.dirty = false;
+
+        m_map[tag] = m_lru.begin();
+
+        return &line;
+    }
+
+    // Fetch count uncached lines starting at tag with a single read
+    bool fill(uint64_t tag, uint64_t count) {
+        uint64_t offset = tag * BLOCK_CACHE_LINE_SIZE;
+        size_t size = std::min(count * BLOCK_CACHE_LINE_SIZE, m_size - offset);
+
+        m_scratch.resize(count * BLOCK_CACHE_LINE_SIZE);
+
+        if (!m_backend->read(offset, m_scratch.data(), size))
+            return false;
+
+        for (uint64_t i = 0; i < count; i++) {
+            line_t* line = insert(tag + i);
+
+            if (!line)
+                return false;
+
+            std::memcpy(line->data.data(), &m_scratch[i * BLOCK_CACHE_LINE_SIZE], valid_bytes(tag + i));
+        }
+
+        return true;
+    }
+
+    // Fetch every uncached line in [first, last), batching runs
+    bool fill_range(uint64_t first, uint64_t last, uint64_t* filled) {
+        uint64_t tag = first;
+
+        while (tag < last) {
+            if (m_map.contains(tag)) {
+                tag++;
+
+                continue;
+            }
+
+            uint64_t end = tag + 1;
+
+            while ((end < last) && !m_map.contains(end))
+                end++;
+
+            if (!fill(tag, end - tag))
+                return false;
+
+            if (filled)
+                *filled += end - tag;
+
+            tag = end;
+        }
+
+        return true;
+    }
+
+public:
+    ~block_cache_t() {
+        flush();
+    }
+
+    /**
+     * @brief Attach the cache to a backend
+     *
+     * @param backend Backend to cache
+     * @param bytes Cache size, rounded down to whole lines
+     */
+    void init(block_backend_t* backend, size_t bytes) {
+        m_backend = backend;
+        m_size = backend->size();
+        m_lines = (m_size + BLOCK_CACHE_LINE_SIZE - 1) / BLOCK_CACHE_LINE_SIZE;
+        m_capacity = std::max((size_t)1, bytes / BLOCK_CACHE_LINE_SIZE);
+
+        // Don't let a single readahead evict most of the cache
+        m_readahead = std::min((size_t)BLOCK_CACHE_READAHEAD, m_capacity / 4);
+
+        m_lru.clear();
+        m_map.clear();
+        m_map.reserve(m_capacity);
+
+        m_next = UINT64_MAX;
+        m_streak = 0;
+        m_stats = { 0 };
+    }
+
+    bool read(uint64_t offset, void* data, size_t size) {
+        if (!size)
+            return true;
+
+        m_streak = (offset == m_next) ? (m_streak + 1) : 0;
+        m_next = offset + size;
+
+        uint64_t first = offset / BLOCK_CACHE_LINE_SIZE;
+        uint64_t last = (offset + size - 1) / BLOCK_CACHE_LINE_SIZE + 1;
+
+        for (uint64_t tag = first; tag < last; tag++)
+            m_map.contains(tag) ? m_stats.hits++ : m_stats.misses++;
+
+        if (!fill_range(first, last, nullptr))
+            return false;
+
+        uint8_t* ptr = (uint8_t*)data;
+
+        while (size) {
+            line_t* line = lookup(offset / BLOCK_CACHE_LINE_SIZE);
+            size_t off = offset % BLOCK_CACHE_LINE_SIZE;
+            size_t chunk = std::min(size, BLOCK_CACHE_LINE_SIZE - off);
+
+            // Only possible if the request is larger than the cache
+            if (!line) {
+                if (!fill(offset / BLOCK_CACHE_LINE_SIZE, 1))
+                    return false;
+
+                line = lookup(offset / BLOCK_CACHE_LINE_SIZE);
+            }
+
+            std::memcpy(ptr, &line->data[off], chunk);
+
+            ptr += chunk;
+            offset += chunk;
+            size -= chunk;
+        }
+
+        // Readahead is speculative, the request itself has been served
+        // so a failure here isn't the guest's problem
+        if ((m_streak >= BLOCK_CACHE_SEQ_THRESHOLD) && m_readahead)
+            fill_range(last, std::min(last + m_readahead, m_lines), &m_stats.readahead);
+
+        return true;
+    }
+
+    bool write(uint64_t offset, const void* data, size_t size) {
+        const uint8_t* ptr = (const uint8_t*)data;
+
+        while (size) {
+            uint64_t tag = offset / BLOCK_CACHE_LINE_SIZE;
+            size_t off = offset % BLOCK_CACHE_LINE_SIZE;
+            size_t chunk = std::min(size, BLOCK_CACHE_LINE_SIZE - off);
+
+            line_t* line = lookup(tag);
+
+            if (!line) {
+                // Lines that are overwritten whole don't need fetching
+                if (!off && (chunk == valid_bytes(tag))) {
+                    line = insert(tag);
+                } else if (fill(tag, 1)) {
+                    line = lookup(tag);
+                }
+
+                if (!line)
+                    return false;
+            }
+
+            std::memcpy(&line->data[off], ptr, chunk);
+
+            line->dirty = true;
+
+            ptr += chunk;
+            offset += chunk;
+            size -= chunk;
+        }
+
+        return true;
+    }
+
+    // Write every dirty line back in LBA order, then flush the backend
+    bool flush() {
+        if (!m_backend)
+            return true;
+
+        std::vector <line_t*> dirty;
+
+        for (line_t& line : m_lru)
+            if (line.dirty)
+                dirty.push_back(&line);
+
+        std::sort(dirty.begin(), dirty.end(), [](line_t* a, line_t* b) {
+            return a->tag < b->tag;
+        });
+
+        bool ok = true;
+
+        for (line_t* line : dirty)
+            ok &= writeback(*line);
+
+        m_backend->flush();
+
+        return ok;
+    }
+
+    const block_cache_stats_t& get_stats() const {
+        return m_stats;
+    }
+};
@@ -0,0 +1,313 @@
+#pragma once
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+
+#include "block_backend.hpp"
+#include "block_raw.hpp"
+
+#define BLOCK_OVERLAY_MAGIC "HV2OVL\0\0"
+#define BLOCK_OVERLAY_VERSION 1
+#define BLOCK_OVERLAY_CLUSTER_SIZE 0x10000
+#define BLOCK_OVERLAY_PATH_MAX 256
+
+/*
+    Overlay (delta) file layout:
+
+    0x000   block_overlay_header_t
+    index   uint32_t per cluster, 0 means the cluster lives in
+            the base image, n means it's stored at
+            data_offset + ((n - 1) * cluster_size)
+    data    Clusters, in allocation order
+
+    The base image is opened read-only and never modified, so any
+    number of overlays can share it. The first write to a cluster
+    copies it from the base into a newly allocated cluster at the
+    end of the delta file.
+*/
+struct block_overlay_header_t {
+    char     magic[8];
+    uint32_t version;
+    uint32_t cluster_size;
+    uint64_t size;
+    uint64_t clusters;
+    uint64_t index_offset;
+    uint64_t data_offset;
+    char     base[BLOCK_OVERLAY_PATH_MAX];
+};
+
+class block_overlay_t : public block_backend_t {
+    block_raw_t m_base;
+
+    std::fstream m_file;
+    std::vector <uint32_t> m_index;
+    std::vector <uint8_t> m_cow;
+
+    block_overlay_header_t m_hdr;
+
+    uint32_t m_allocated = 0;
+
+    bool m_read_only = false;
+
+    uint64_t cluster_offset(uint32_t entry) {
+        return m_hdr.data_offset + ((uint64_t)(entry - 1) * m_hdr.cluster_size);
+    }
+
+    bool allocate(uint64_t cluster) {
+        uint32_t entry = m_allocated + 1;
+        uint64_t base = cluster * m_hdr.cluster_size;
+        size_t size = std::min((uint64_t)m_hdr.cluster_size, m_hdr.size - base);
+
+        // Copy the whole cluster from the base image first, the
+        // caller's write will then overwrite part (or all) of it
+        std::fill(m_cow.begin(), m_cow.end(), 0);
+
+        if (!m_base.read(base, m_cow.data(), size))
+            return false;
+
+        m_file.seekp(cluster_offset(entry));
+        m_file.write((char*)m_cow.data(), m_hdr.cluster_size);
+
+        m_file.seekp(m_hdr.index_offset + (cluster * sizeof(uint32_t)));
+        m_file.write((char*)&entry, sizeof(uint32_t));
+
+        if (!m_file) {
+            // Keep the stream usable, the cluster is retried on the
+            // next write to it
+            m_file.clear();
+
+            return false;
+        }
+
+        m_index[cluster] = entry;
+        m_allocated = entry;
+
+        return true;
+    }
+
+public:
+    ~block_overlay_t() {
+        close();
+    }
+
+    /**
+     * @brief Create an empty overlay on top of a base image
+     *
+     * @param path Overlay file to create (truncated if it exists)
+     * @param base Base image path, stored as an absolute path in the
+     *        overlay header
+     * @param cluster_size Allocation unit in bytes
+     * @return true on success
+     */
+    static bool create(std::string path, std::string base, uint32_t cluster_size = BLOCK_OVERLAY_CLUSTER_SIZE) {
+        std::error_code ec;
+
+        // The overlay may be opened from another directory later on
+        base = std::filesystem::absolute(base, ec).lexically_normal().string();
+
+        if (ec || (base.size() >= BLOCK_OVERLAY_PATH_MAX))
+            return false;
+
+        block_raw_t raw;
+
+        if (!raw.open(base, true))
+            return false;
+
+        block_overlay_header_t hdr;
+
+        std::memset(&hdr, 0, sizeof(hdr));
+        std::memcpy(hdr.magic, BLOCK_OVERLAY_MAGIC, 8);
+        std::strcpy(hdr.base, base.c_str());
+
+        hdr.version = BLOCK_OVERLAY_VERSION;
+        hdr.cluster_size = cluster_size;
+        hdr.size = raw.size();
+        hdr.clusters = (hdr.size + cluster_size - 1) / cluster_size;
+        hdr.index_offset = sizeof(hdr);
+
+        uint64_t index_end = hdr.index_offset + (hdr.clusters * sizeof(uint32_t));
+
+        // Keep clusters aligned to their own size inside the delta
+        hdr.data_offset = (index_end + cluster_size - 1) / cluster_size * cluster_size;
+
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+
+        if (!file.is_open())
+            return false;
+
+        std::vector <uint32_t> index(hdr.clusters, 0);
+
+        file.write((char*)&hdr, sizeof(hdr));
+        file.write((char*)index.data(), index.size() * sizeof(uint32_t));
+
+        return (bool)file;
+    }
+
+    static bool probe(std::string path) {
+        std::ifstream file(path, std::ios::binary);
+
+        char magic[8];
+
+        if (!file.read(magic, 8))
+            return false;
+
+        return !std::memcmp(magic, BLOCK_OVERLAY_MAGIC, 8);
+    }
+
+    bool open(std::string path, bool read_only = false) {
+        close();
+
+        m_read_only = read_only;
+
+        std::ios::openmode mode = std::ios::binary | std::ios::in;
+
+        if (!read_only)
+            mode |= std::ios::out;
+
+        m_file.open(path, mode);
+
+        if (!m_file.is_open())
+            return false;
+
+        m_file.read((char*)&m_hdr, sizeof(m_hdr));
+
+        if (!m_file || std::memcmp(m_hdr.magic, BLOCK_OVERLAY_MAGIC, 8) ||
+            (m_hdr.version != BLOCK_OVERLAY_VERSION) || !m_hdr.cluster_size) {
+            close();
+
+            return false;
+        }
+
+        // The index must cover the whole image, every access looks it up
+        if (m_hdr.clusters != ((m_hdr.size + m_hdr.cluster_size - 1) / m_hdr.cluster_size)) {
+            close();
+
+            return false;
+        }
+
+        m_hdr.base[BLOCK_OVERLAY_PATH_MAX - 1] = '\0';
+
+        // Relative base paths are relative to the overlay itself
+        std::filesystem::path base = m_hdr.base;
+
+        if (base.is_relative())
+            base = std::filesystem::path(path).parent_path() / base;
+
+        // A base that changed size under us means the overlay is stale
+        if (!m_base.open(base.string(), true) || (m_base.size() != m_hdr.size)) {
+            close();
+
+            return false;
+        }
+
+        m_index.resize(m_hdr.clusters);
+        m_cow.resize(m_hdr.cluster_size);
+
+        m_file.seekg(m_hdr.index_offset);
+        m_file.read((char*)m_index.data(), m_index.size() * sizeof(uint32_t));
+
+        if (!m_file) {
+            close();
+
+            return false;
+        }
+
+        m_allocated = 0;
+
+        for (uint32_t entry : m_index)
+            m_allocated = std::max(m_allocated, entry);
+
+        return true;
+    }
+
+    void close() {
+        if (m_file.is_open()) {
+            m_file.flush();
+            m_file.close();
+        }
+
+        m_file.clear();
+        m_base.close();
+        m_index.clear();
+        m_allocated = 0;
+    }
+
+    uint64_t size() override {
+        return m_hdr.size;
+    }
+
+    bool read(uint64_t offset, void* data, size_t size) override {
+        if ((offset > m_hdr.size) || (size > (m_hdr.size - offset)))
+            return false;
+
+        uint8_t* ptr = (uint8_t*)data;
+
+        while (size) {
+            uint64_t cluster = offset / m_hdr.cluster_size;
+            uint32_t off = offset % m_hdr.cluster_size;
+            size_t chunk = std::min(size, (size_t)(m_hdr.cluster_size - off));
+
+            uint32_t entry = m_index[cluster];
+
+            if (entry) {
+                m_file.seekg(cluster_offset(entry) + off);
+                m_file.read((char*)ptr, chunk);
+
+                if (!m_file) {
+                    m_file.clear();
+
+                    return false;
+                }
+            } else if (!m_base.read(offset, ptr, chunk)) {
+                return false;
+            }
+
+            ptr += chunk;
+            offset += chunk;
+            size -= chunk;
+        }
+
+        return true;
+    }
+
+    bool write(uint64_t offset, const void* data, size_t size) override {
+        if (m_read_only || (offset > m_hdr.size) || (size > (m_hdr.size - offset)))
+            return false;
+
+        const uint8_t* ptr = (const uint8_t*)data;
+
+        while (size) {
+            uint64_t cluster = offset / m_hdr.cluster_size;
+            uint32_t off = offset % m_hdr.cluster_size;
+            size_t chunk = std::min(size, (size_t)(m_hdr.cluster_size - off));
+
+            if (!m_index[cluster] && !allocate(cluster))
+                return false;
+
+            m_file.seekp(cluster_offset(m_index[cluster]) + off);
+            m_file.write((const char*)ptr, chunk);
+
+            if (!m_file) {
+                m_file.clear();
+
+                return false;
+            }
+
+            ptr += chunk;
+            offset += chunk;
+            size -= chunk;
+        }
+
+        return true;
+    }
+
+    void flush() override {
+        if (m_file.is_open())
+            m_file.flush();
+    }
+};
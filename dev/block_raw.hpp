@@ -0,0 +1,177 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <cstring>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "block_backend.hpp"
+
+/*
+    Raw images are mapped whole into our address space, reads and
+    writes are plain memcpys and the host's page cache does the
+    actual I/O. flush() forces dirty pages back to the image.
+*/
+class block_raw_t : public block_backend_t {
+    uint8_t* m_map = nullptr;
+
+#ifdef _WIN32
+    HANDLE m_file = INVALID_HANDLE_VALUE;
+    HANDLE m_mapping = NULL;
+#else
+    int m_fd = -1;
+#endif
+
+    uint64_t m_bytes = 0;
+    bool m_read_only = false;
+
+public:
+    ~block_raw_t() {
+        close();
+    }
+
+    bool open(std::string path, bool read_only = false) {
+        close();
+
+        m_read_only = read_only;
+
+#ifdef _WIN32
+        m_file = CreateFileA(
+            path.c_str(),
+            read_only ? GENERIC_READ : (GENERIC_READ | GENERIC_WRITE),
+            FILE_SHARE_READ,
+            NULL,
+            OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL,
+            NULL
+        );
+
+        if (m_file == INVALID_HANDLE_VALUE)
+            return false;
+
+        LARGE_INTEGER size;
+
+        if (!GetFileSizeEx(m_file, &size) || !size.QuadPart) {
+            close();
+
+            return false;
+        }
+
+        m_bytes = size.QuadPart;
+
+        m_mapping = CreateFileMappingA(m_file, NULL, read_only ? PAGE_READONLY : PAGE_READWRITE, 0, 0, NULL);
+
+        if (!m_mapping) {
+            close();
+
+            return false;
+        }
+
+        m_map = (uint8_t*)MapViewOfFile(m_mapping, read_only ? FILE_MAP_READ : FILE_MAP_ALL_ACCESS, 0, 0, 0);
+#else
+        m_fd = ::open(path.c_str(), read_only ? O_RDONLY : O_RDWR);
+
+        if (m_fd == -1)
+            return false;
+
+        struct stat st;
+
+        if (fstat(m_fd, &st) || !st.st_size) {
+            close();
+
+            return false;
+        }
+
+        m_bytes = st.st_size;
+
+        int prot = read_only ? PROT_READ : (PROT_READ | PROT_WRITE);
+
+        void* map = mmap(nullptr, m_bytes, prot, MAP_SHARED, m_fd, 0);
+
+        m_map = (map == MAP_FAILED) ? nullptr : (uint8_t*)map;
+#endif
+
+        if (!m_map) {
+            close();
+
+            return false;
+        }
+
+        return true;
+    }
+
+    void close() {
+        if (m_map)
+            flush();
+
+#ifdef _WIN32
+        if (m_map) UnmapViewOfFile(m_map);
+        if (m_mapping) CloseHandle(m_mapping);
+        if (m_file != INVALID_HANDLE_VALUE) CloseHandle(m_file);
+
+        m_mapping = NULL;
+        m_file = INVALID_HANDLE_VALUE;
+#else
+        if (m_map) munmap(m_map, m_bytes);
+        if (m_fd != -1) ::close(m_fd);
+
+        m_fd = -1;
+#endif
+
+        m_map = nullptr;
+        m_bytes = 0;
+    }
+
+    uint64_t size() override {
+        return m_bytes;
+    }
+
+    uint8_t* map(uint64_t offset, size_t size) override {
+        if (m_read_only || (offset > m_bytes) || (size > (m_bytes - offset)))
+            return nullptr;
+
+        return m_map + offset;
+    }
+
+    bool read(uint64_t offset, void* data, size_t size) override {
+        if ((offset > m_bytes) || (size > (m_bytes - offset)))
+            return false;
+
+        std::memcpy(data, m_map + offset, size);
+
+        return true;
+    }
+
+    bool write(uint64_t offset, const void* data, size_t size) override {
+        uint8_t* ptr = map(offset, size);
+
+        if (!ptr)
+            return false;
+
+        std::memcpy(ptr, data, size);
+
+        return true;
+    }
+
+    void flush() override {
+        if (!m_map || m_read_only)
+            return;
+
+#ifdef _WIN32
+        FlushViewOfFile(m_map, 0);
+        FlushFileBuffers(m_file);
+#else
+        msync(m_map, m_bytes, MS_SYNC);
+#endif
+    }
+};
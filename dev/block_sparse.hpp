@@ -0,0 +1,411 @@
+#pragma once
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+
+#include "block_backend.hpp"
+#include "lz4.hpp"
+
+#define BLOCK_SPARSE_MAGIC "HV2SPR\0\0"
+#define BLOCK_SPARSE_VERSION 1
+#define BLOCK_SPARSE_CLUSTER_SIZE 0x10000
+
+// Header flags
+#define BLOCK_SPARSE_COMPRESS 0x00000001
+
+// Cluster flags
+#define BLOCK_SPARSE_LZ4 0x00000001
+
+/*
+    Sparse image layout:
+
+    0x000   block_sparse_header_t
+    index   block_sparse_entry_t per cluster, a zero offset means
+            the cluster is unallocated and reads as zeroes
+    data    Clusters, LZ4-compressed when that saves space
+
+    Writes decompress the cluster, patch it and store it again.
+    The new data reuses the cluster's slot if it fits and is
+    appended to the file otherwise, clusters that become all
+    zeroes are deallocated. Space left behind by relocated
+    clusters is only reclaimed by converting the image again.
+*/
+struct block_sparse_header_t {
+    char     magic[8];
+    uint32_t version;
+    uint32_t cluster_size;
+    uint64_t size;
+    uint64_t clusters;
+    uint64_t index_offset;
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+struct block_sparse_entry_t {
+    uint64_t offset;
+    uint32_t size;
+    uint32_t flags;
+};
+
+class block_sparse_t : public block_backend_t {
+    std::fstream m_file;
+    std::vector <block_sparse_entry_t> m_index;
+
+    // Last cluster we decoded, sequential sector accesses
+    // usually hit the same cluster several times in a row
+    std::vector <uint8_t> m_cluster;
+    std::vector <uint8_t> m_packed;
+    uint64_t m_cached = UINT64_MAX;
+
+    block_sparse_header_t m_hdr;
+
+    uint64_t m_end = 0;
+
+    bool m_read_only = false;
+
+    static bool is_zero(const uint8_t* buf, size_t size) {
+        for (size_t i = 0; i < size; i++)
+            if (buf[i])
+                return false;
+
+        return true;
+    }
+
+    bool load(uint64_t cluster) {
+        if (m_cached == cluster)
+            return true;
+
+        m_cached = UINT64_MAX;
+
+        const block_sparse_entry_t& e = m_index[cluster];
+
+        if (!e.offset) {
+            std::fill(m_cluster.begin(), m_cluster.end(), 0);
+        } else if (e.flags & BLOCK_SPARSE_LZ4) {
+            m_file.seekg(e.offset);
+            m_file.read((char*)m_packed.data(), e.size);
+
+            if (!m_file) {
+                m_file.clear();
+
+                return false;
+            }
+
+            long size = lz4::decompress(m_packed.data(), e.size, m_cluster.data(), m_hdr.cluster_size);
+
+            if (size != (long)m_hdr.cluster_size)
+                return false;
+        } else {
+            m_file.seekg(e.offset);
+            m_file.read((char*)m_cluster.data(), m_hdr.cluster_size);
+
+            if (!m_file) {
+                m_file.clear();
+
+                return false;
+            }
+        }
+
+        m_cached = cluster;
+
+        return true;
+    }
+
+    bool store(uint64_t cluster) {
+        block_sparse_entry_t& e = m_index[cluster];
+        block_sparse_entry_t ne = { 0, 0, 0 };
+
+        if (!is_zero(m_cluster.data(), m_hdr.cluster_size)) {
+            const uint8_t* data = m_cluster.data();
+
+            ne.size = m_hdr.cluster_size;
+
+            if (m_hdr.flags & BLOCK_SPARSE_COMPRESS) {
+                size_t size = lz4::compress(m_cluster.data(), m_hdr.cluster_size, m_packed.data(), m_hdr.cluster_size - 1);
+
+                if (size) {
+                    data = m_packed.data();
+                    ne.size = size;
+                    ne.flags = BLOCK_SPARSE_LZ4;
+                }
+            }
+
+            if (e.offset && (ne.size <= e.size)) {
+                ne.offset = e.offset;
+            } else {
+                ne.offset = m_end;
+                m_end += ne.size;
+            }
+
+            m_file.seekp(ne.offset);
+            m_file.write((const char*)data, ne.size);
+        }
+
+        m_file.seekp(m_hdr.index_offset + (cluster * sizeof(block_sparse_entry_t)));
+        m_file.write((const char*)&ne, sizeof(ne));
+
+        // Keep the old entry and a usable stream if the write failed
+        if (!m_file) {
+            m_file.clear();
+
+            return false;
+        }
+
+        e = ne;
+
+        return true;
+    }
+
+public:
+    ~block_sparse_t() {
+        close();
+    }
+
+    static bool probe(std::string path) {
+        std::ifstream file(path, std::ios::binary);
+
+        char magic[8];
+
+        if (!file.read(magic, 8))
+            return false;
+
+        return !std::memcmp(magic, BLOCK_SPARSE_MAGIC, 8);
+    }
+
+    /**
+     * @brief Convert an image to the sparse format, all-zero
+     *        clusters are skipped
+     *
+     * @param src Source image
+     * @param path Sparse image to create (truncated if it exists)
+     * @param compress Compress clusters with LZ4
+     * @param stored Receives the number of clusters written
+     * @return true on success
+     */
+    static bool convert(block_backend_t& src, std::string path, bool compress, uint64_t* stored = nullptr) {
+        block_sparse_header_t hdr;
+
+        std::memset(&hdr, 0, sizeof(hdr));
+        std::memcpy(hdr.magic, BLOCK_SPARSE_MAGIC, 8);
+
+        hdr.version = BLOCK_SPARSE_VERSION;
+        hdr.cluster_size = BLOCK_SPARSE_CLUSTER_SIZE;
+        hdr.size = src.size();
+        hdr.clusters = (hdr.size + hdr.cluster_size - 1) / hdr.cluster_size;
+        hdr.index_offset = sizeof(hdr);
+        hdr.flags = compress ? BLOCK_SPARSE_COMPRESS : 0;
+
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+
+        if (!file.is_open())
+            return false;
+
+        std::vector <block_sparse_entry_t> index(hdr.clusters, { 0, 0, 0 });
+        std::vector <uint8_t> cluster(hdr.cluster_size);
+        std::vector <uint8_t> packed(hdr.cluster_size);
+
+        uint64_t end = hdr.index_offset + (hdr.clusters * sizeof(block_sparse_entry_t));
+
+        if (stored)
+            *stored = 0;
+
+        file.seekp(end);
+
+        for (uint64_t i = 0; i < hdr.clusters; i++) {
+            uint64_t offset = i * hdr.cluster_size;
+            size_t size = std::min((uint64_t)hdr.cluster_size, hdr.size - offset);
+
+            // The tail of a partial last cluster reads as zeroes
+            std::fill(cluster.begin(), cluster.end(), 0);
+
+            if (!src.read(offset, cluster.data(), size))
+                return false;
+
+            if (is_zero(cluster.data(), hdr.cluster_size))
+                continue;
+
+            const uint8_t* data = cluster.data();
+            block_sparse_entry_t& e = index[i];
+
+            e.offset = end;
+            e.size = hdr.cluster_size;
+
+            if (compress) {
+                size_t csize = lz4::compress(cluster.data(), hdr.cluster_size, packed.data(), hdr.cluster_size - 1);
+
+                if (csize) {
+                    data = packed.data();
+                    e.size = csize;
+                    e.flags = BLOCK_SPARSE_LZ4;
+                }
+            }
+
+            file.write((const char*)data, e.size);
+
+            end += e.size;
+
+            if (stored)
+                (*stored)++;
+        }
+
+        file.seekp(0);
+        file.write((const char*)&hdr, sizeof(hdr));
+        file.write((const char*)index.data(), index.size() * sizeof(block_sparse_entry_t));
+
+        return (bool)file;
+    }
+
+    bool open(std::string path, bool read_only = false) {
+        close();
+
+        m_read_only = read_only;
+
+        std::ios::openmode mode = std::ios::binary | std::ios::in;
+
+        if (!read_only)
+            mode |= std::ios::out;
+
+        m_file.open(path, mode);
+
+        if (!m_file.is_open())
+            return false;
+
+        m_file.read((char*)&m_hdr, sizeof(m_hdr));
+
+        if (!m_file || std::memcmp(m_hdr.magic, BLOCK_SPARSE_MAGIC, 8) ||
+            (m_hdr.version != BLOCK_SPARSE_VERSION) || !m_hdr.cluster_size) {
+            close();
+
+            return false;
+        }
+
+        // The index must cover the whole image, every access looks it up
+        if (m_hdr.clusters != ((m_hdr.size + m_hdr.cluster_size - 1) / m_hdr.cluster_size)) {
+            close();
+
+            return false;
+        }
+
+        m_index.resize(m_hdr.clusters);
+        m_cluster.resize(m_hdr.cluster_size);
+        m_packed.resize(m_hdr.cluster_size);
+
+        m_file.seekg(m_hdr.index_offset);
+        m_file.read((char*)m_index.data(), m_index.size() * sizeof(block_sparse_entry_t));
+
+        if (!m_file) {
+            close();
+
+            return false;
+        }
+
+        m_end = m_hdr.index_offset + (m_hdr.clusters * sizeof(block_sparse_entry_t));
+
+        for (const block_sparse_entry_t& e : m_index) {
+            if (!e.offset)
+                continue;
+
+            // Clusters are decoded into cluster_size buffers, a corrupt
+            // entry must not be able to overflow them
+            bool valid = (e.flags & BLOCK_SPARSE_LZ4) ?
+                (e.size && (e.size <= m_hdr.cluster_size)) :
+                (e.size == m_hdr.cluster_size);
+
+            if (!valid) {
+                close();
+
+                return false;
+            }
+
+            m_end = std::max(m_end, e.offset + e.size);
+        }
+
+        return true;
+    }
+
+    void close() {
+        if (m_file.is_open()) {
+            m_file.flush();
+            m_file.close();
+        }
+
+        m_file.clear();
+        m_index.clear();
+        m_cached = UINT64_MAX;
+    }
+
+    uint64_t size() override {
+        return m_hdr.size;
+    }
+
+    bool read(uint64_t offset, void* data, size_t size) override {
+        if ((offset > m_hdr.size) || (size > (m_hdr.size - offset)))
+            return false;
+
+        uint8_t* ptr = (uint8_t*)data;
+
+        while (size) {
+            uint64_t cluster = offset / m_hdr.cluster_size;
+            uint32_t off = offset % m_hdr.cluster_size;
+            size_t chunk = std::min(size, (size_t)(m_hdr.cluster_size - off));
+
+            // Holes don't need the cluster buffer
+            if (!m_index[cluster].offset) {
+                std::memset(ptr, 0, chunk);
+            } else {
+                if (!load(cluster))
+                    return false;
+
+                std::memcpy(ptr, &m_cluster[off], chunk);
+            }
+
+            ptr += chunk;
+            offset += chunk;
+            size -= chunk;
+        }
+
+        return true;
+    }
+
+    bool write(uint64_t offset, const void* data, size_t size) override {
+        if (m_read_only || (offset > m_hdr.size) || (size > (m_hdr.size - offset)))
+            return false;
+
+        const uint8_t* ptr = (const uint8_t*)data;
+
+        while (size) {
+            uint64_t cluster = offset / m_hdr.cluster_size;
+            uint32_t off = offset % m_hdr.cluster_size;
+            size_t chunk = std::min(size, (size_t)(m_hdr.cluster_size - off));
+
+            // Zeroes written to a hole leave it a hole
+            if (m_index[cluster].offset || !is_zero(ptr, chunk)) {
+                if (!load(cluster))
+                    return false;
+
+                std::memcpy(&m_cluster[off], ptr, chunk);
+
+                if (!store(cluster)) {
+                    m_cached = UINT64_MAX;
+
+                    return false;
+                }
+            }
+
+            ptr += chunk;
+            offset += chunk;
+            size -= chunk;
+        }
+
+        return true;
+    }
+
+    void flush() override {
+        if (m_file.is_open())
+            m_file.flush();
+    }
+};
@@ -0,0 +1,210 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+
+#include "io_device.hpp"
+#include "pci_device.hpp"
+#include "pic.hpp"
+#include "hv2/hv2.hpp"
+#include "hv2/mmu.hpp"
+
+#define DMA_BASE 0xc160
+#define DMA_SIZE 0x20
+
+// Chunk size for ranges that aren't backed by memory
+#define DMA_BOUNCE_SIZE 0x1000
+
+/*
+    Copy/fill engine for guest physical memory. Writing START to
+    CTRL runs the whole operation before the write returns, memory
+    ranges are copied with a host memcpy/memset and anything else
+    (i.e. VRAM) goes through the device's own write handler. Ranges
+    in I/O space are rejected.
+
+    Registers (32-bit):
+*/
+#define DMA_REG_SRC    0x00 // RW - Source physical address
+#define DMA_REG_DST    0x04 // RW - Destination physical address
+#define DMA_REG_LEN    0x08 // RW - Length in bytes
+#define DMA_REG_FILL   0x0c // RW - Fill pattern, repeated every 4 bytes
+#define DMA_REG_CTRL   0x10 // RW - Control
+#define DMA_REG_STATUS 0x14 // RW - Status, write 1s to clear
+
+#define DMA_CTRL_START 0x00000001 // Run the operation, self-clearing
+#define DMA_CTRL_FILL  0x00000002 // Fill DST with FILL instead of copying SRC
+#define DMA_CTRL_IRQ   0x00000004 // Interrupt on completion
+
+#define DMA_STATUS_DONE  0x00000001
+#define DMA_STATUS_ERROR 0x00000002 // Part of a range wasn't mapped or was in I/O space
+
+class io_device_dma_t : public io_device_t {
+    hv2_t* cpu = nullptr;
+    io_device_pic_t* pic = nullptr;
+
+    io_device_port_list_t ports;
+
+    uint16_t base = DMA_BASE;
+
+    uint32_t src    = 0;
+    uint32_t dst    = 0;
+    uint32_t len    = 0;
+    uint32_t fill   = 0;
+    uint32_t ctrl   = 0;
+    uint32_t status = 0;
+
+    std::vector <uint8_t> bounce;
+
+    // Set while an operation runs, a write that lands on our own
+    // registers can't start another one
+    bool running = false;
+
+    bool dma_copy() {
+        uint8_t* s = hv2_mmu_get_dma_ptr(cpu, src, len);
+        uint8_t* d = hv2_mmu_get_dma_ptr(cpu, dst, len);
+
+        // Ranges may overlap, like memmove
+        if (s && d) {
+            std::memmove(d, s, len);
+
+            return true;
+        }
+
+        bool backwards = (dst > src) && (dst < (src + len));
+
+        for (uint32_t done = 0; done < len;) {
+            uint32_t chunk = std::min(len - done, (uint32_t)DMA_BOUNCE_SIZE);
+            uint32_t off = backwards ? (len - done - chunk) : done;
+
+            if (!hv2_mmu_dma_read(cpu, src + off, bounce.data(), chunk))
+                return false;
+
+            if (!hv2_mmu_dma_write(cpu, dst + off, bounce.data(), chunk))
+                return false;
+
+            done += chunk;
+        }
+
+        return true;
+    }
+
+    bool dma_fill() {
+        uint8_t pattern[4];
+
+        std::memcpy(pattern, &fill, 4);
+
+        uint8_t* d = hv2_mmu_get_dma_ptr(cpu, dst, len);
+
+        if (d && (fill == (pattern[0] * 0x01010101u))) {
+            std::memset(d, pattern[0], len);
+
+            return true;
+        }
+
+        // The pattern is anchored to DST, not to 4-byte boundaries
+        for (uint32_t i = 0; i < DMA_BOUNCE_SIZE; i++)
+            bounce[i] = pattern[i & 3];
+
+        for (uint32_t done = 0; done < len;) {
+            uint32_t chunk = std::min(len - done, (uint32_t)DMA_BOUNCE_SIZE);
+
+            if (d) {
+                std::memcpy(d + done, bounce.data(), chunk);
+            } else if (!hv2_mmu_dma_write(cpu, dst + done, bounce.data(), chunk)) {
+                return false;
+            }
+
+            done += chunk;
+        }
+
+        return true;
+    }
+
+    void dma_start() {
+        if (running)
+            return;
+
+        running = true;
+
+        bool ok = (ctrl & DMA_CTRL_FILL) ? dma_fill() : dma_copy();
+
+        running = false;
+
+        ctrl &= ~DMA_CTRL_START;
+        status |= DMA_STATUS_DONE | (ok ? 0 : DMA_STATUS_ERROR);
+
+        if ((ctrl & DMA_CTRL_IRQ) && pic)
+            pic->raise(PIC_LINE_DMA);
+    }
+
+public:
+    io_device_port_list_t* get_port_list() override {
+        return &ports;
+    }
+
+    pci_desc_t get_pci_desc() {
+        return {
+            0x0003,
+            0x4856,  // hv2
+            0x0000,
+            0x00ff,
+            0x0008,    // Base System Peripheral
+            0x0001,    // DMA Controller
+            0x0000,
+            0x0001,    // Rev. 1
+            0x0000,
+            0x0000,    // Header Type 0
+            0x0000,
+            0x0000,
+            PCI_IO_BAR(base), // Registers
+            0x00000000,
+            0x00000000,
+            0x00000000,
+            0x00000000,
+            0x00000000,
+            // BAR sizes:
+            { DMA_SIZE, 0, 0, 0, 0, 0 }
+        };
+    }
+
+    uint32_t read(uint32_t port, int size) override {
+        switch (port - base) {
+            case DMA_REG_SRC   : return src;
+            case DMA_REG_DST   : return dst;
+            case DMA_REG_LEN   : return len;
+            case DMA_REG_FILL  : return fill;
+            case DMA_REG_CTRL  : return ctrl;
+            case DMA_REG_STATUS: return status;
+        }
+
+        return 0;
+    }
+
+    void write(uint32_t port, uint32_t value, int size) override {
+        switch (port - base) {
+            case DMA_REG_SRC   : { src = value; } break;
+            case DMA_REG_DST   : { dst = value; } break;
+            case DMA_REG_LEN   : { len = value; } break;
+            case DMA_REG_FILL  : { fill = value; } break;
+            case DMA_REG_STATUS: { status &= ~value; } break;
+            case DMA_REG_CTRL  : {
+                ctrl = value;
+
+                if (ctrl & DMA_CTRL_START)
+                    dma_start();
+            } break;
+        }
+    }
+
+    void init(hv2_t* cpu, io_device_pic_t* pic) {
+        this->cpu = cpu;
+        this->pic = pic;
+
+        bounce.resize(DMA_BOUNCE_SIZE);
+
+        for (uint16_t p = 0; p < DMA_SIZE; p++)
+            ports.push_back(base + p);
+    }
+};
@@ -5,11 +5,10 @@
 
 #include "io_device.hpp"
 #include "pci_device.hpp"
+#include "pic.hpp"
 #include "hv2/exception.hpp"
 #include "hv2/hv2.hpp"
 
-#define HV2_CAUSE_KBC 0xd0000000
-
 #define PS2_DATA 0x60
 #define PS2_STAT 0x64
 #define PS2_COMM 0x64
@@ -69,6 +68,7 @@ typedef void (*i8042_kevent_t)(uint32_t);
 
 class io_device_i8042_t : public io_device_t {
     hv2_t* cpu = nullptr;
+    io_device_pic_t* pic = nullptr;
 
     // Controller Configuration Byte
     uint8_t cfg = 0;
@@ -101,7 +101,7 @@ public:
             0x00008042, // i8042 PS/2 Keyboard Controller
             0x00008086, // Intel Corporation
             0x00000000, // Status
-            0x00000000, // Command
+            PCI_CMD_IO, // Command
             0x00000009, // Input Device Controller
             0x00000000, // Keyboard Controller
             0x00000000, // PIF
@@ -116,7 +116,9 @@ public:
             0x00000000,
             0x00000000,
             0x00000000,
-            0x00000000
+            0x00000000,
+            // BAR sizes:
+            { 4, 4, 0, 0, 0, 0 }
         };
     }
 
@@ -310,19 +312,20 @@ public:
             return;
 
         if (CFG_BIT_SET(PS2_CFG_FPIRQ))
-            hv2_exception(cpu, HV2_CAUSE_KBC);
+            pic->raise(PIC_LINE_KBC);
         
         SET_STATUS(PS2_STAT_OUT_FULL)
 
         out = kcode & 0xff;
     }
 
-    void init(hv2_t* cpu) {
+    void init(hv2_t* cpu, io_device_pic_t* pic) {
         SET_CFG_BIT(PS2_CFG_FPCLK)
         SET_CFG_BIT(PS2_CFG_FPIRQ)
         SET_CFG_BIT(PS2_CFG_SPCLK)
         CLR_CFG_BIT(PS2_CFG_SPIRQ)
 
         this->cpu = cpu;
+        this->pic = pic;
     }
 };
\ No newline at end of file
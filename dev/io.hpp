@@ -3,55 +3,73 @@
 #include <vector>
 #include <cstdio>
 #include <array>
+#include <algorithm>
 
 #include "hv2/mmu_device.hpp"
 #include "io_device.hpp"
 
+#define IO_PORT_COUNT 0x10000
+
 class dev_io_t : public hv2_mmio_device_t {
     std::vector <io_device_t*> devices;
 
+    // Flat port -> device table, one entry per port
+    std::vector <io_device_t*> port_map = std::vector <io_device_t*>(IO_PORT_COUNT, nullptr);
+
     uint32_t base;
 
 public:
     hv2_range_t get_physical_range() override {
-        return { base, base + 0x10000 };
+        return { base, base + IO_PORT_COUNT };
     }
 
     uint32_t read(uint32_t addr, int size) override {
         uint32_t port = addr - base;
 
-        for (io_device_t* dev : devices) {
-            io_device_port_list_t* pl = dev->get_port_list();
+        io_device_t* dev = port_map[port];
 
-            for (uint16_t dev_port : *pl) {
-                if (port == dev_port) return dev->read(port, size);
-            }
-        }
+        if (!dev || !dev->decode)
+            return 0xffffffff;
 
-        return 0xffffffff;
+        return dev->read(port, size);
     }
 
     void write(uint32_t addr, uint32_t value, int size) override {
         uint32_t port = addr - base;
 
-        for (io_device_t* dev : devices) {
-            io_device_port_list_t* pl = dev->get_port_list();
-
-            for (uint16_t dev_port : *pl) {
-                if (port == dev_port) {
-                    dev->write(port, value, size);
+        io_device_t* dev = port_map[port];
 
-                    return;
-                }
-            }
-        }
+        if (dev && dev->decode)
+            dev->write(port, value, size);
     }
 
     void init(uint32_t base) {
         this->base = base;
+        this->io_space = true;
+    }
+
+    /**
+     * @brief Rebuild the port table from every device's port list,
+     *        must be called whenever a device changes its ports
+     *
+     * Devices registered first take precedence on conflicting ports
+     */
+    void rebuild_port_map() {
+        std::fill(port_map.begin(), port_map.end(), nullptr);
+
+        for (io_device_t* dev : devices) {
+            for (uint16_t port : *dev->get_port_list()) {
+                if (!port_map[port])
+                    port_map[port] = dev;
+            }
+        }
     }
 
     void register_device(io_device_t* dev) {
+        dev->io = this;
+
         devices.push_back(dev);
+
+        rebuild_port_map();
     }
 };
\ No newline at end of file
@@ -5,8 +5,16 @@
 
 typedef std::vector <uint16_t> io_device_port_list_t;
 
+class dev_io_t;
+
 class io_device_t {
 public:
+    // Bus this device is registered on, set by dev_io_t::register_device
+    dev_io_t* io = nullptr;
+
+    // Cleared when I/O decode is disabled through PCI
+    bool decode = true;
+
     virtual io_device_port_list_t* get_port_list() = 0;
     virtual uint32_t read(uint32_t, int) = 0;
     virtual void write(uint32_t, uint32_t, int) = 0;
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <deque>
+#include <vector>
+
+typedef void (*io_worker_job_t)(void*);
+
+/*
+    Fixed-size pool of host threads for device backing-store I/O.
+    Devices queue jobs and keep executing the guest, jobs signal
+    their own completion (usually through an atomic flag the device
+    checks from the emulation thread).
+*/
+class io_worker_pool_t {
+    struct job_t {
+        io_worker_job_t fn;
+        void* udata;
+    };
+
+    std::vector <std::thread> threads;
+    std::deque <job_t> queue;
+    std::mutex mtx;
+    std::condition_variable cv;
+
+    bool stopping = false;
+
+    void worker() {
+        while (true) {
+            job_t job;
+
+            {
+                std::unique_lock <std::mutex> lock(mtx);
+
+                cv.wait(lock, [this] { return stopping || !queue.empty(); });
+
+                if (queue.empty())
+                    return;
+
+                job = queue.front();
+
+                queue.pop_front();
+            }
+
+            job.fn(job.udata);
+        }
+    }
+
+public:
+    ~io_worker_pool_t() {
+        stop();
+    }
+
+    void init(int count) {
+        for (int i = 0; i < count; i++)
+            threads.emplace_back(&io_worker_pool_t::worker, this);
+    }
+
+    void submit(io_worker_job_t fn, void* udata) {
+        {
+            std::lock_guard <std::mutex> lock(mtx);
+
+            queue.push_back({ fn, udata });
+        }
+
+        cv.notify_one();
+    }
+
+    // Drains every queued job, then joins the threads
+    void stop() {
+        {
+            std::lock_guard <std::mutex> lock(mtx);
+
+            stopping = true;
+        }
+
+        cv.notify_all();
+
+        for (std::thread& t : threads)
+            t.join();
+
+        threads.clear();
+    }
+};
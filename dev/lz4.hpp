@@ -0,0 +1,231 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+/*
+    Minimal LZ4 block format codec, used for compressed disk image
+    clusters. Greedy single-probe matcher, fast rather than tight.
+*/
+#define LZ4_MIN_MATCH    4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MF_LIMIT     12
+#define LZ4_HASH_BITS    12
+#define LZ4_MAX_OFFSET   0xffff
+
+namespace lz4 {
+    inline uint32_t read32(const uint8_t* p) {
+        uint32_t v;
+
+        std::memcpy(&v, p, 4);
+
+        return v;
+    }
+
+    inline uint32_t hash(uint32_t v) {
+        return (v * 2654435761u) >> (32 - LZ4_HASH_BITS);
+    }
+
+    // Writes a 4-bit length field's overflow bytes
+    inline bool write_length(uint8_t*& op, const uint8_t* oend, size_t len) {
+        while (len >= 255) {
+            if (op >= oend)
+                return false;
+
+            *op++ = 255;
+            len -= 255;
+        }
+
+        if (op >= oend)
+            return false;
+
+        *op++ = (uint8_t)len;
+
+        return true;
+    }
+
+    inline bool emit_sequence(uint8_t*& op, const uint8_t* oend, const uint8_t* lit, size_t lit_len, size_t offset, size_t match_len) {
+        if (op >= oend)
+            return false;
+
+        uint8_t* token = op++;
+        size_t ml = match_len ? (match_len - LZ4_MIN_MATCH) : 0;
+
+        *token = (uint8_t)(((lit_len < 15) ? lit_len : 15) << 4);
+
+        if (lit_len >= 15)
+            if (!write_length(op, oend, lit_len - 15))
+                return false;
+
+        if ((size_t)(oend - op) < lit_len)
+            return false;
+
+        std::memcpy(op, lit, lit_len);
+
+        op += lit_len;
+
+        // The last sequence has literals only
+        if (!match_len)
+            return true;
+
+        if ((oend - op) < 2)
+            return false;
+
+        *op++ = offset & 0xff;
+        *op++ = offset >> 8;
+
+        *token |= (ml < 15) ? ml : 15;
+
+        if (ml >= 15)
+            if (!write_length(op, oend, ml - 15))
+                return false;
+
+        return true;
+    }
+
+    /**
+     * @brief Compress a buffer
+     *
+     * @param src Input
+     * @param size Input size
+     * @param dst Output
+     * @param capacity Output buffer size
+     * @return Compressed size, 0 if the output didn't fit
+     */
+    inline size_t compress(const void* src, size_t size, void* dst, size_t capacity) {
+        const uint8_t* ip = (const uint8_t*)src;
+        const uint8_t* base = ip;
+        const uint8_t* iend = ip + size;
+        const uint8_t* anchor = ip;
+        uint8_t* op = (uint8_t*)dst;
+        const uint8_t* oend = op + capacity;
+
+        uint32_t table[1 << LZ4_HASH_BITS];
+
+        std::memset(table, 0xff, sizeof(table));
+
+        if (size > LZ4_MF_LIMIT) {
+            const uint8_t* mflimit = iend - LZ4_MF_LIMIT;
+
+            while (ip < mflimit) {
+                uint32_t h = hash(read32(ip));
+                uint32_t ref_pos = table[h];
+
+                table[h] = (uint32_t)(ip - base);
+
+                const uint8_t* ref = base + ref_pos;
+
+                if ((ref_pos == 0xffffffff) || ((size_t)(ip - ref) > LZ4_MAX_OFFSET) || (read32(ref) != read32(ip))) {
+                    ip++;
+
+                    continue;
+                }
+
+                // Extend the match, stopping short of the trailing literals
+                const uint8_t* matchlimit = iend - LZ4_LAST_LITERALS;
+                const uint8_t* mp = ip + LZ4_MIN_MATCH;
+                const uint8_t* rp = ref + LZ4_MIN_MATCH;
+
+                while ((mp < matchlimit) && (*mp == *rp)) {
+                    mp++;
+                    rp++;
+                }
+
+                if (!emit_sequence(op, oend, anchor, ip - anchor, ip - ref, mp - ip))
+                    return 0;
+
+                ip = mp;
+                anchor = ip;
+            }
+        }
+
+        if (!emit_sequence(op, oend, anchor, iend - anchor, 0, 0))
+            return 0;
+
+        return op - (uint8_t*)dst;
+    }
+
+    /**
+     * @brief Decompress a buffer
+     *
+     * @param src Compressed input
+     * @param size Compressed size
+     * @param dst Output
+     * @param capacity Output buffer size
+     * @return Decompressed size, -1 on malformed input
+     */
+    inline long decompress(const void* src, size_t size, void* dst, size_t capacity) {
+        const uint8_t* ip = (const uint8_t*)src;
+        const uint8_t* iend = ip + size;
+        uint8_t* op = (uint8_t*)dst;
+        uint8_t* ostart = op;
+        uint8_t* oend = op + capacity;
+
+        while (ip < iend) {
+            uint8_t token = *ip++;
+            size_t len = token >> 4;
+
+            if (len == 15) {
+                uint8_t b;
+
+                do {
+                    if (ip >= iend)
+                        return -1;
+
+                    b = *ip++;
+                    len += b;
+                } while (b == 255);
+            }
+
+            if (((size_t)(iend - ip) < len) || ((size_t)(oend - op) < len))
+                return -1;
+
+            std::memcpy(op, ip, len);
+
+            op += len;
+            ip += len;
+
+            // End of block
+            if (ip == iend)
+                break;
+
+            if ((iend - ip) < 2)
+                return -1;
+
+            size_t offset = ip[0] | (ip[1] << 8);
+
+            ip += 2;
+
+            if (!offset || (offset > (size_t)(op - ostart)))
+                return -1;
+
+            len = (token & 0xf) + LZ4_MIN_MATCH;
+
+            if ((token & 0xf) == 15) {
+                uint8_t b;
+
+                do {
+                    if (ip >= iend)
+                        return -1;
+
+                    b = *ip++;
+                    len += b;
+                } while (b == 255);
+            }
+
+            if ((size_t)(oend - op) < len)
+                return -1;
+
+            // Matches can overlap their own output, copy bytewise
+            const uint8_t* ref = op - offset;
+
+            for (size_t i = 0; i < len; i++)
+                op[i] = ref[i];
+
+            op += len;
+        }
+
+        return op - ostart;
+    }
+}
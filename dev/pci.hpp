@@ -19,37 +19,124 @@
 #include "io_device.hpp"
 #include "pci_device.hpp"
 
+#include "hv2/mmu_device.hpp"
+
 #include <vector>
 #include <cstdint>
+#include <cstring>
 
 #define PCI_CFG_ADDR 0xcf8
 #define PCI_CFG_DATA 0xcfc
 
+// bus:8, device:5, function:3
+#define PCI_SLOT_COUNT 0x10000
+#define PCI_SLOT(bus, device, function) \
+    ((((bus) & 0xff) << 8) | (((device) & 0x1f) << 3) | ((function) & 0x7))
+
 class io_device_pci_t : public io_device_t {
-    std::vector <pci_device_t*> devices;
-
-    pci_device_t* search_device(int bus, int device) {
-        for (pci_device_t* dev : devices)
-            if ((dev->bus == bus) && (dev->device == device))
-                return dev;
-        
-        return nullptr;
-    }
+    // Registered devices, indexed directly by PCI_SLOT
+    std::vector <pci_device_t*> slots = std::vector <pci_device_t*>(PCI_SLOT_COUNT, nullptr);
 
     io_device_port_list_t ports = {
-        PCI_CFG_ADDR, PCI_CFG_DATA
+        PCI_CFG_ADDR,
+        PCI_CFG_DATA + 0, PCI_CFG_DATA + 1,
+        PCI_CFG_DATA + 2, PCI_CFG_DATA + 3
     };
 
+    static uint32_t& cfg_dword(pci_device_t* dev, uint32_t reg) {
+        return *(uint32_t*)&dev->cfg[reg & 0xfc];
+    }
+
+    void build_config_space(pci_device_t* dev) {
+        pci_desc_t& d = dev->desc;
+
+        std::memset(dev->cfg, 0, PCI_CFG_SIZE);
+
+        cfg_dword(dev, PCI_CFG_VENDOR)  = (d.devid    << 16) | (d.vendor & 0xffff);
+        cfg_dword(dev, PCI_CFG_COMMAND) = (d.status   << 16) | (d.command & 0xffff);
+        cfg_dword(dev, PCI_CFG_REV)     = (d.devclass << 24) |
+                                          ((d.subclass & 0xff) << 16) |
+                                          ((d.pif      & 0xff) << 8 ) |
+                                          ((d.rev      & 0xff) << 0 );
+        cfg_dword(dev, PCI_CFG_CLSIZE)  = ((d.bist     & 0xff) << 24) |
+                                          ((d.hdr      & 0xff) << 16) |
+                                          ((d.lat      & 0xff) << 8 ) |
+                                          ((d.clsize   & 0xff) << 0 );
+
+        for (int i = 0; i < 6; i++)
+            cfg_dword(dev, PCI_CFG_BAR0 + (i * 4)) = d.bar[i];
+    }
+
+    // Turn the device's decoders on or off to match its command register
+    void apply_command(pci_device_t* dev) {
+        uint32_t cmd = cfg_dword(dev, PCI_CFG_COMMAND);
+
+        if (dev->io_dev)
+            dev->io_dev->decode = cmd & PCI_CMD_IO;
+
+        if (dev->mmio_dev)
+            dev->mmio_dev->decode = cmd & PCI_CMD_MEM;
+    }
+
+    // Apply a write to a configuration dword, only writable
+    // fields are updated
+    void write_config(pci_device_t* dev, uint32_t reg, uint32_t value) {
+        uint32_t& cfg = cfg_dword(dev, reg);
+
+        switch (reg & 0xfc) {
+            case PCI_CFG_COMMAND: {
+                // Status is RW1C, we never set any of its bits
+                cfg = (cfg & 0xffff0000) | (value & PCI_CMD_WRITABLE);
+
+                apply_command(dev);
+            } break;
+
+            case PCI_CFG_CLSIZE: {
+                cfg = (cfg & 0xffff0000) | (value & 0xffff);
+            } break;
+
+            case PCI_CFG_INT_LINE: {
+                cfg = (cfg & 0xffffff00) | (value & 0xff);
+            } break;
+
+            default: {
+                if (((reg & 0xfc) < PCI_CFG_BAR0) || ((reg & 0xfc) > PCI_CFG_BAR5))
+                    break;
+
+                int bar = ((reg & 0xfc) - PCI_CFG_BAR0) >> 2;
+
+                uint32_t size = dev->desc.bar_size[bar];
+
+                if (!size)
+                    break;
+
+                // Devices decode at fixed addresses, so BARs can't be
+                // moved. Writing all 1s reads back ~(size - 1) plus the
+                // type bits, which is how BARs are sized, any other write
+                // restores the base address
+                uint32_t type_mask = (dev->desc.bar[bar] & PCI_BAR_IO) ? 0x3 : 0xf;
+
+                if ((value | type_mask) == 0xffffffff) {
+                    cfg = (~(size - 1) & ~type_mask) | (dev->desc.bar[bar] & type_mask);
+                } else {
+                    cfg = dev->desc.bar[bar];
+                }
+            } break;
+        }
+    }
+
 public:
     uint32_t addr;
-    uint8_t bus, device, function, reg;
-    bool enable;
 
-    void register_device(pci_device_t* dev, int bus, int device) {
-        dev->bus    = bus;
-        dev->device = device;
+    void register_device(pci_device_t* dev, int bus, int device, int function = 0) {
+        dev->bus      = bus;
+        dev->device   = device;
+        dev->function = function;
+
+        build_config_space(dev);
+        apply_command(dev);
 
-        devices.push_back(dev);
+        slots[PCI_SLOT(bus, device, function)] = dev;
     }
 
     io_device_port_list_t* get_port_list() override {
@@ -57,81 +144,53 @@ public:
     }
 
     uint32_t read(uint32_t port, int size) override {
-        switch (port) {
-            case PCI_CFG_ADDR: {
-                return addr;
-            } break;
+        if (port == PCI_CFG_ADDR)
+            return addr;
 
-            case PCI_CFG_DATA: {
-                reg      = (addr >> 0 ) & 0xfc;
-                function = (addr >> 8 ) & 0x7;
-                device   = (addr >> 11) & 0x1f;
-                bus      = (addr >> 16) & 0xff;
-                enable   =  addr & 0x80000000;
-
-                pci_device_t* dev = search_device(bus, device);
-
-                if (!dev)
-                    return 0xffffffff;
-
-                switch (reg >> 2) {
-                    case 0x0: return (dev->desc.devid    << 16) |
-                                     (dev->desc.vendor   << 0 ); break;
-                    case 0x1: return (dev->desc.status   << 16); break;
-                    case 0x2: return (dev->desc.devclass << 24) |
-                                     (dev->desc.subclass << 16) |
-                                     (dev->desc.pif      << 8 ) |
-                                     (dev->desc.rev      << 0 ); break;
-                    case 0x3: return (dev->desc.bist     << 24) |
-                                     (dev->desc.hdr      << 16) |
-                                     (dev->desc.lat      << 8 ) |
-                                     (dev->desc.clsize   << 0 ); break;
-
-                    case 0x4: case 0x5: case 0x6: case 0x7: case 0x8: case 0x9: {
-                        return dev->desc.bar[(reg >> 2) - 0x4];
-                    } break;
-                    default: {
-                        return 0xffffffff;
-                        // Unsupported PCI register read
-                    } break;
-                }
+        pci_device_t* dev = slots[(addr >> 8) & 0xffff];
 
-                return 0xffffffff;
-            } break;
+        if (!dev)
+            return 0xffffffff;
+
+        // Byte and short accesses can target any lane of PCI_CFG_DATA
+        int shift = (port - PCI_CFG_DATA) * 8;
+
+        uint32_t v = cfg_dword(dev, addr) >> shift;
+
+        switch (size) {
+            case HV2_BYTE: return v & 0xff;
+            case HV2_SHORT: return v & 0xffff;
         }
 
-        return 0xffffffff;
+        return v;
     }
 
     void write(uint32_t port, uint32_t value, int size) override {
-        switch (port) {
-            case PCI_CFG_ADDR: {
-                addr = value;
-            } break;
+        if (port == PCI_CFG_ADDR) {
+            addr = value;
 
-            case PCI_CFG_DATA: {
-                reg      = (addr >> 0 ) & 0xfc;
-                function = (addr >> 8 ) & 0x7;
-                device   = (addr >> 11) & 0x1f;
-                bus      = (addr >> 16) & 0xff;
-                enable   =  addr & 0x80000000;
-                
-                pci_device_t* dev = search_device(bus, device);
-
-                if (!dev)
-                    return;
-
-                switch (reg >> 2) {
-                    case 0x1: {
-                        if (!value) dev->disabled = true;
-
-                        //dev->execute_command(value);
-                    } break;
-                    default: {
-                        // Unsupported PCI register write
-                    }
-                }
-            } break;
+            return;
+        }
+
+        pci_device_t* dev = slots[(addr >> 8) & 0xffff];
+
+        if (!dev)
+            return;
+
+        int shift = (port - PCI_CFG_DATA) * 8;
+
+        uint32_t mask;
+
+        switch (size) {
+            case HV2_BYTE: mask = 0xff; break;
+            case HV2_SHORT: mask = 0xffff; break;
+            default: mask = 0xffffffff; break;
         }
+
+        mask <<= shift;
+
+        uint32_t old = cfg_dword(dev, addr);
+
+        write_config(dev, addr, (old & ~mask) | ((value << shift) & mask));
     }
 };
\ No newline at end of file
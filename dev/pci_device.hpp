@@ -4,8 +4,28 @@
 
 #define PCI_BAR_MEM 0
 #define PCI_BAR_IO  1
-#define PCI_IO_BAR(port) ((port & 0xfffffffc) | PCI_BAR_IO)
-#define PCI_MEM_BAR(addr) ((addr & 0xfffffff0) | PCI_BAR_MEM)
+#define PCI_IO_BAR(port) (((port) & 0xfffffffc) | PCI_BAR_IO)
+#define PCI_MEM_BAR(addr) (((addr) & 0xfffffff0) | PCI_BAR_MEM)
+
+// Command register
+#define PCI_CMD_IO           0x0001
+#define PCI_CMD_MEM          0x0002
+#define PCI_CMD_BUS_MASTER   0x0004
+#define PCI_CMD_PARITY       0x0040
+#define PCI_CMD_SERR         0x0100
+#define PCI_CMD_INTX_DISABLE 0x0400
+#define PCI_CMD_WRITABLE     (PCI_CMD_IO | PCI_CMD_MEM | PCI_CMD_BUS_MASTER | \
+                              PCI_CMD_PARITY | PCI_CMD_SERR | PCI_CMD_INTX_DISABLE)
+
+// Type 0 configuration space header offsets
+#define PCI_CFG_VENDOR     0x00
+#define PCI_CFG_COMMAND    0x04
+#define PCI_CFG_REV        0x08
+#define PCI_CFG_CLSIZE     0x0c
+#define PCI_CFG_BAR0       0x10
+#define PCI_CFG_BAR5       0x24
+#define PCI_CFG_INT_LINE   0x3c
+#define PCI_CFG_SIZE       0x100
 
 struct pci_desc_t {
     uint32_t devid;
@@ -21,12 +41,25 @@ struct pci_desc_t {
     uint32_t lat;
     uint32_t clsize;
     uint32_t bar[6];
+
+    // Size of the region decoded by each BAR (power of 2), 0 means the
+    // BAR is read-only and can't be sized
+    uint32_t bar_size[6];
 };
 
+class io_device_t;
+class hv2_mmio_device_t;
+
 struct pci_device_t {
-    // Don't support multi-function devices yet
-    int bus, device;
-    bool disabled = false;
+    int bus, device, function;
+
+    // Decoders switched by the command register's IO and MEM enables
+    io_device_t* io_dev = nullptr;
+    hv2_mmio_device_t* mmio_dev = nullptr;
 
     pci_desc_t desc;
+
+    // Configuration space image, built from desc on registration
+    // and kept up to date on writes
+    uint8_t cfg[PCI_CFG_SIZE];
 };
\ No newline at end of file
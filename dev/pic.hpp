@@ -0,0 +1,220 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include "io_device.hpp"
+#include "pci_device.hpp"
+#include "hv2/exception.hpp"
+#include "hv2/sched.hpp"
+#include "hv2/hv2.hpp"
+
+#define PIC_BASE 0xc200
+#define PIC_SIZE 0x40
+#define PIC_LINES 32
+
+// Fixed line assignments
+#define PIC_LINE_KBC   0
+#define PIC_LINE_ATA   1
+#define PIC_LINE_VBLK  2
+#define PIC_LINE_DMA   4
+#define PIC_LINE_TIMER 5
+
+/*
+    Interrupt controller. Devices raise lines from any thread by
+    setting a pending bit and notifying the scheduler, the CPU only
+    takes interrupts between scheduler runs, never in the middle of
+    an instruction. The cause is HV2_CAUSE_IRQ | line.
+
+    A line is delivered when it's pending, unmasked and has a higher
+    priority than every line in service. It stays in service until
+    its EOI, unless AEOI is set.
+
+    xpc and xcause only hold one exception, so nothing is delivered
+    while the CPU runs a handler unless that handler opts in by
+    setting PIC_CTRL_NEST, which it should only do after saving xpc
+    and xcause. A nested line must still beat every line in service.
+    Delivering an interrupt clears NEST again, so every handler has
+    to opt in on its own. Held lines are delivered after the last
+    sysret.
+
+    Registers (32-bit):
+*/
+#define PIC_REG_PENDING 0x00 // RW - Pending lines, write 1s to clear
+#define PIC_REG_MASK    0x04 // RW - Masked lines, all masked on reset
+#define PIC_REG_ISR     0x08 // R  - Lines in service
+#define PIC_REG_EOI     0x0c // W  - End the interrupt on this line
+#define PIC_REG_CTRL    0x10 // RW - Control
+#define PIC_REG_CURRENT 0x14 // R  - Highest priority line in service, PIC_NO_LINE if none
+#define PIC_REG_PRIO(n) (0x20 + (((n) >> 3) * 4)) // RW - 4 bits per line, 0 is highest
+
+#define PIC_CTRL_AEOI 0x00000001 // Don't keep lines in service
+#define PIC_CTRL_NEST 0x00000002 // Let the running handler be preempted
+
+#define PIC_NO_LINE 0xffffffff
+
+class io_device_pic_t : public io_device_t {
+    hv2_t* cpu = nullptr;
+
+    io_device_port_list_t ports;
+
+    uint16_t base = PIC_BASE;
+
+    // Set from any thread, everything else is emulation thread only
+    std::atomic <uint32_t> pending = 0;
+
+    uint32_t mask = 0xffffffff;
+    uint32_t isr = 0;
+    uint32_t ctrl = 0;
+    uint32_t prio[PIC_LINES / 8] = { 0 };
+
+    int pic_priority(int line) {
+        return (prio[line >> 3] >> ((line & 7) * 4)) & 0xf;
+    }
+
+    // Highest priority line in lines, ties go to the lowest line
+    int pic_highest(uint32_t lines) {
+        int best = -1;
+
+        for (int i = 0; lines; i++, lines >>= 1) {
+            if (!(lines & 1))
+                continue;
+
+            if ((best == -1) || (pic_priority(i) < pic_priority(best)))
+                best = i;
+        }
+
+        return best;
+    }
+
+    // Re-evaluate delivery at the next run boundary
+    void pic_kick() {
+        if (cpu && cpu->sched)
+            hv2_sched_notify(cpu->sched);
+    }
+
+    void pic_deliver() {
+        uint32_t ready = pending.load(std::memory_order_acquire) & ~mask;
+
+        if (!ready)
+            return;
+
+        // Wait for sysret, delivering now would clobber xpc/xcause
+        if (cpu->handler_depth && !(ctrl & PIC_CTRL_NEST))
+            return;
+
+        int line = pic_highest(ready);
+
+        if (isr && (pic_priority(line) >= pic_priority(pic_highest(isr))))
+            return;
+
+        pending.fetch_and(~(1u << line), std::memory_order_relaxed);
+
+        if (!(ctrl & PIC_CTRL_AEOI))
+            isr |= 1u << line;
+
+        // The new handler hasn't saved anything yet
+        ctrl &= ~PIC_CTRL_NEST;
+
+        hv2_exception(cpu, HV2_CAUSE_IRQ | line);
+
+        // Only one line is taken per pass, look at the rest again. A
+        // blocked line doesn't kick, sysret or EOI does that
+        if (pending.load(std::memory_order_relaxed) & ~mask)
+            hv2_sched_kick(cpu->sched);
+    }
+
+    static void pic_watch(void* udata) {
+        ((io_device_pic_t*)udata)->pic_deliver();
+    }
+
+public:
+    /**
+     * @brief Latch an interrupt on line, safe to call from any thread
+     */
+    void raise(int line) {
+        pending.fetch_or(1u << line, std::memory_order_release);
+
+        pic_kick();
+    }
+
+    io_device_port_list_t* get_port_list() override {
+        return &ports;
+    }
+
+    pci_desc_t get_pci_desc() {
+        return {
+            0x0005,
+            0x4856,  // hv2
+            0x0000,
+            0x00ff,
+            0x0008,    // Base System Peripheral
+            0x0000,    // PIC
+            0x0000,
+            0x0001,    // Rev. 1
+            0x0000,
+            0x0000,    // Header Type 0
+            0x0000,
+            0x0000,
+            PCI_IO_BAR(base), // Registers
+            0x00000000,
+            0x00000000,
+            0x00000000,
+            0x00000000,
+            0x00000000,
+            // BAR sizes:
+            { PIC_SIZE, 0, 0, 0, 0, 0 }
+        };
+    }
+
+    uint32_t read(uint32_t port, int size) override {
+        uint32_t reg = port - base;
+
+        if ((reg >= PIC_REG_PRIO(0)) && (reg < PIC_REG_PRIO(PIC_LINES)))
+            return prio[(reg - PIC_REG_PRIO(0)) >> 2];
+
+        switch (reg) {
+            case PIC_REG_PENDING: return pending.load(std::memory_order_acquire);
+            case PIC_REG_MASK   : return mask;
+            case PIC_REG_ISR    : return isr;
+            case PIC_REG_CTRL   : return ctrl;
+            case PIC_REG_CURRENT: return isr ? pic_highest(isr) : PIC_NO_LINE;
+        }
+
+        return 0;
+    }
+
+    void write(uint32_t port, uint32_t value, int size) override {
+        uint32_t reg = port - base;
+
+        if ((reg >= PIC_REG_PRIO(0)) && (reg < PIC_REG_PRIO(PIC_LINES))) {
+            prio[(reg - PIC_REG_PRIO(0)) >> 2] = value;
+
+            pic_kick();
+
+            return;
+        }
+
+        switch (reg) {
+            case PIC_REG_PENDING: { pending.fetch_and(~value, std::memory_order_relaxed); } break;
+            case PIC_REG_MASK   : { mask = value; } break;
+            case PIC_REG_EOI    : { isr &= ~(1u << (value & 0x1f)); } break;
+            case PIC_REG_CTRL   : { ctrl = value & (PIC_CTRL_AEOI | PIC_CTRL_NEST); } break;
+        }
+
+        // Unmasking or ending an interrupt can let a pending line through
+        pic_kick();
+    }
+
+    void init(hv2_t* cpu) {
+        this->cpu = cpu;
+
+        for (uint16_t p = 0; p < PIC_SIZE; p++)
+            ports.push_back(base + p);
+    }
+
+    // Deliver interrupts whenever the scheduler is notified
+    void attach(hv2_sched_t* sched) {
+        hv2_sched_watch(sched, pic_watch, this);
+    }
+};
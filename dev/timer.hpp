@@ -0,0 +1,215 @@
+#pragma once
+
+#include <cstdint>
+
+#include "io_device.hpp"
+#include "pci_device.hpp"
+#include "pic.hpp"
+#include "hv2/sched.hpp"
+#include "hv2/hv2.hpp"
+
+#define TIMER_BASE 0xc180
+#define TIMER_SIZE 0x80
+#define TIMER_COMPARATORS 4
+
+/*
+    HPET-style timer. The main counter is the scheduler's cycle
+    count, each comparator is a scheduler event armed for the cycle
+    it matches on, so nothing is polled while the guest runs.
+
+    Registers (32-bit):
+*/
+#define TIMER_REG_COUNTER_LO 0x00 // R  - Main counter, in cycles
+#define TIMER_REG_COUNTER_HI 0x04 // R
+#define TIMER_REG_FREQ       0x08 // R  - Counter frequency in Hz
+#define TIMER_REG_STATUS     0x0c // RW - Fired comparators, write 1s to clear
+
+// Comparator n registers are at TIMER_REG_CMP(n) + offset
+#define TIMER_REG_CMP(n)     (0x10 + ((n) * 0x10))
+#define TIMER_CMP_VALUE_LO   0x00 // RW - Counter value to fire at
+#define TIMER_CMP_VALUE_HI   0x04 // RW
+#define TIMER_CMP_PERIOD     0x08 // RW - Cycles between periodic interrupts
+#define TIMER_CMP_CTRL       0x0c // RW - Control
+
+#define TIMER_CTRL_ENABLE   0x00000001
+#define TIMER_CTRL_PERIODIC 0x00000002 // Re-arm every PERIOD cycles, one-shot otherwise
+#define TIMER_CTRL_IRQ      0x00000004 // Interrupt when firing
+
+class io_device_timer_t : public io_device_t {
+    hv2_t* cpu = nullptr;
+    io_device_pic_t* pic = nullptr;
+
+    io_device_port_list_t ports;
+
+    uint16_t base = TIMER_BASE;
+
+    struct comparator_t {
+        io_device_timer_t* timer;
+        int index;
+
+        uint64_t value;
+        uint32_t period;
+        uint32_t ctrl;
+
+        // Scheduler event, 0 if not armed
+        uint64_t event;
+    } cmp[TIMER_COMPARATORS];
+
+    uint32_t status = 0;
+    uint32_t freq = 0;
+
+    uint64_t timer_now() {
+        return cpu->sched ? cpu->sched->now : 0;
+    }
+
+    void timer_arm(comparator_t& c) {
+        hv2_sched_t* sched = cpu->sched;
+
+        if (!sched)
+            return;
+
+        if (c.event)
+            hv2_sched_cancel(sched, c.event);
+
+        c.event = 0;
+
+        if (!(c.ctrl & TIMER_CTRL_ENABLE))
+            return;
+
+        uint64_t now = sched->now;
+        uint64_t delay = (c.value > now) ? (c.value - now) : 0;
+
+        c.event = hv2_sched_add(sched, delay, timer_event, &c);
+    }
+
+    void timer_fire(comparator_t& c) {
+        c.event = 0;
+
+        status |= 1 << c.index;
+
+        if ((c.ctrl & TIMER_CTRL_PERIODIC) && c.period) {
+            uint64_t now = timer_now();
+
+            // Skip the periods we missed instead of firing a burst
+            c.value += c.period;
+
+            if (c.value <= now)
+                c.value = now + c.period - ((now - c.value) % c.period);
+
+            timer_arm(c);
+        } else {
+            c.ctrl &= ~TIMER_CTRL_ENABLE;
+        }
+
+        if (c.ctrl & TIMER_CTRL_IRQ)
+            pic->raise(PIC_LINE_TIMER);
+    }
+
+    static void timer_event(void* udata) {
+        comparator_t* c = (comparator_t*)udata;
+
+        c->timer->timer_fire(*c);
+    }
+
+    uint32_t read_cmp(comparator_t& c, uint32_t reg) {
+        switch (reg) {
+            case TIMER_CMP_VALUE_LO: return c.value & 0xffffffff;
+            case TIMER_CMP_VALUE_HI: return c.value >> 32;
+            case TIMER_CMP_PERIOD  : return c.period;
+            case TIMER_CMP_CTRL    : return c.ctrl;
+        }
+
+        return 0;
+    }
+
+    void write_cmp(comparator_t& c, uint32_t reg, uint32_t value) {
+        switch (reg) {
+            case TIMER_CMP_VALUE_LO: { c.value = (c.value & 0xffffffff00000000ull) | value; } break;
+            case TIMER_CMP_VALUE_HI: { c.value = (c.value & 0xffffffffull) | ((uint64_t)value << 32); } break;
+            case TIMER_CMP_PERIOD  : { c.period = value; } break;
+            case TIMER_CMP_CTRL    : { c.ctrl = value & (TIMER_CTRL_ENABLE | TIMER_CTRL_PERIODIC | TIMER_CTRL_IRQ); } break;
+        }
+
+        timer_arm(c);
+    }
+
+public:
+    io_device_port_list_t* get_port_list() override {
+        return &ports;
+    }
+
+    pci_desc_t get_pci_desc() {
+        return {
+            0x0004,
+            0x4856,  // hv2
+            0x0000,
+            0x00ff,
+            0x0008,    // Base System Peripheral
+            0x0002,    // Timer
+            0x0001,    // HPET
+            0x0001,    // Rev. 1
+            0x0000,
+            0x0000,    // Header Type 0
+            0x0000,
+            0x0000,
+            PCI_IO_BAR(base), // Registers
+            0x00000000,
+            0x00000000,
+            0x00000000,
+            0x00000000,
+            0x00000000,
+            // BAR sizes:
+            { TIMER_SIZE, 0, 0, 0, 0, 0 }
+        };
+    }
+
+    uint32_t read(uint32_t port, int size) override {
+        uint32_t reg = port - base;
+
+        if (reg >= TIMER_REG_CMP(0)) {
+            int n = (reg - TIMER_REG_CMP(0)) >> 4;
+
+            if (n >= TIMER_COMPARATORS)
+                return 0;
+
+            return read_cmp(cmp[n], reg & 0xf);
+        }
+
+        switch (reg) {
+            case TIMER_REG_COUNTER_LO: return timer_now() & 0xffffffff;
+            case TIMER_REG_COUNTER_HI: return timer_now() >> 32;
+            case TIMER_REG_FREQ      : return freq;
+            case TIMER_REG_STATUS    : return status;
+        }
+
+        return 0;
+    }
+
+    void write(uint32_t port, uint32_t value, int size) override {
+        uint32_t reg = port - base;
+
+        if (reg >= TIMER_REG_CMP(0)) {
+            int n = (reg - TIMER_REG_CMP(0)) >> 4;
+
+            if (n < TIMER_COMPARATORS)
+                write_cmp(cmp[n], reg & 0xf, value);
+
+            return;
+        }
+
+        if (reg == TIMER_REG_STATUS)
+            status &= ~value;
+    }
+
+    void init(hv2_t* cpu, io_device_pic_t* pic, uint32_t freq) {
+        this->cpu = cpu;
+        this->pic = pic;
+        this->freq = freq;
+
+        for (int i = 0; i < TIMER_COMPARATORS; i++)
+            cmp[i] = { this, i, 0, 0, 0, 0 };
+
+        for (uint16_t p = 0; p < TIMER_SIZE; p++)
+            ports.push_back(base + p);
+    }
+};
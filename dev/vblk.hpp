@@ -0,0 +1,555 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+
+#include "io_device.hpp"
+#include "pci_device.hpp"
+#include "io_worker.hpp"
+#include "block.hpp"
+#include "pic.hpp"
+#include "hv2/hv2.hpp"
+#include "hv2/mmu.hpp"
+
+
+#define VBLK_BASE 0xc100
+#define VBLK_SIZE 0x40
+
+#define VBLK_SECTOR_SIZE 512
+#define VBLK_QUEUE_MAX 256
+
+/*
+    Paravirtual block device, a virtio-style split ring in guest
+    memory. The guest fills descriptors, publishes request heads in
+    the available ring and writes NOTIFY once per batch. The host
+    runs the whole batch on a worker thread, then posts every
+    request to the used ring and raises a single interrupt.
+
+    Registers (32-bit):
+*/
+#define VBLK_REG_CAPACITY_LO 0x00 // R  - Capacity in sectors
+#define VBLK_REG_CAPACITY_HI 0x04 // R
+#define VBLK_REG_QUEUE_MAX   0x08 // R  - Maximum queue size
+#define VBLK_REG_QUEUE_SIZE  0x0c // RW - Queue size, power of 2
+#define VBLK_REG_QUEUE_DESC  0x10 // RW - Descriptor table physical address
+#define VBLK_REG_QUEUE_AVAIL 0x14 // RW - Available ring physical address
+#define VBLK_REG_QUEUE_USED  0x18 // RW - Used ring physical address
+#define VBLK_REG_STATUS      0x1c // RW - Device status, writing 0 resets the device
+#define VBLK_REG_NOTIFY      0x20 // W  - Doorbell
+#define VBLK_REG_ISR         0x24 // R  - Interrupt status, cleared on read
+
+#define VBLK_STATUS_DRIVER_OK 0x00000001 // Queue is set up, set by the guest
+#define VBLK_STATUS_FAILED    0x00000080 // Queue addresses were invalid, set by the device
+
+#define VBLK_ISR_USED 0x00000001
+
+// Descriptor flags
+#define VBLK_DESC_NEXT  0x0001 // Chain continues in the next field
+#define VBLK_DESC_WRITE 0x0002 // Device writes to this buffer
+
+// Available ring flags
+#define VBLK_AVAIL_NO_INTERRUPT 0x0001
+
+// Request types
+#define VBLK_T_IN    0
+#define VBLK_T_OUT   1
+#define VBLK_T_FLUSH 4
+#define VBLK_T_GET_ID 8
+
+// Request status, written to the last descriptor of the chain
+#define VBLK_S_OK     0
+#define VBLK_S_IOERR  1
+#define VBLK_S_UNSUPP 2
+
+#define VBLK_ID_BYTES 20
+
+struct vblk_desc_t {
+    uint32_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+struct vblk_used_elem_t {
+    uint32_t id;
+    uint32_t len;
+};
+
+// First descriptor of every request chain
+struct vblk_req_hdr_t {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+};
+
+class io_device_vblk_t : public io_device_t {
+    hv2_t* cpu = nullptr;
+    io_device_pic_t* pic = nullptr;
+
+    io_device_port_list_t ports;
+
+    block_dev_t blk;
+
+    struct segment_t {
+        uint8_t* ptr;
+        uint32_t size;
+    };
+
+    struct request_t {
+        uint16_t head;
+        bool valid;
+        vblk_req_hdr_t hdr;
+        std::vector <segment_t> data;
+        uint8_t* status;
+        uint32_t written;
+        uint8_t result;
+    };
+
+    uint16_t base = VBLK_BASE;
+
+    uint32_t queue_size  = 0;
+    uint32_t queue_desc  = 0;
+    uint32_t queue_avail = 0;
+    uint32_t queue_used  = 0;
+    uint32_t status      = 0;
+    uint32_t isr         = 0;
+
+    // Host views of the rings, resolved on DRIVER_OK
+    vblk_desc_t* desc = nullptr;
+    uint16_t* avail = nullptr;
+    uint16_t* used = nullptr;
+
+    uint16_t last_avail = 0;
+
+    // Batch in flight on the worker, and whether the guest rang
+    // the doorbell again in the meantime
+    std::vector <request_t> batch;
+    std::vector <uint8_t> bounce;
+    bool busy = false;
+    bool kick_pending = false;
+
+    // Bumped on reset, a batch submitted under an older generation
+    // belongs to rings that no longer exist
+    uint32_t generation = 0;
+    uint32_t batch_generation = 0;
+
+    std::atomic <bool> done = false;
+
+    // Declared last so it's joined before the block device goes away
+    io_worker_pool_t workers;
+
+    void vblk_raise_irq() {
+        isr |= VBLK_ISR_USED;
+
+        // avail[0] is the flags field
+        if (avail[0] & VBLK_AVAIL_NO_INTERRUPT)
+            return;
+
+        if (pic)
+            pic->raise(PIC_LINE_VBLK);
+    }
+
+    void vblk_reset() {
+        queue_size  = 0;
+        queue_desc  = 0;
+        queue_avail = 0;
+        queue_used  = 0;
+        status      = 0;
+        isr         = 0;
+        last_avail  = 0;
+
+        kick_pending = false;
+        generation++;
+
+        desc  = nullptr;
+        avail = nullptr;
+        used  = nullptr;
+    }
+
+    bool vblk_setup_queue() {
+        if (!queue_size || (queue_size > VBLK_QUEUE_MAX) || (queue_size & (queue_size - 1)))
+            return false;
+
+        desc  = (vblk_desc_t*)hv2_mmu_get_dma_ptr(cpu, queue_desc, queue_size * sizeof(vblk_desc_t));
+        avail = (uint16_t*)hv2_mmu_get_dma_ptr(cpu, queue_avail, 4 + (queue_size * 2));
+        used  = (uint16_t*)hv2_mmu_get_dma_ptr(cpu, queue_used, 4 + (queue_size * sizeof(vblk_used_elem_t)));
+
+        last_avail = 0;
+
+        return desc && avail && used;
+    }
+
+    // Walk a descriptor chain and resolve every buffer to host memory
+    void vblk_parse_request(request_t& req) {
+        req.valid = false;
+        req.status = nullptr;
+        req.written = 0;
+        req.result = VBLK_S_IOERR;
+        req.data.clear();
+
+        std::vector <const vblk_desc_t*> chain;
+
+        uint16_t idx = req.head;
+
+        while (true) {
+            // A chain longer than the table has to be a loop
+            if ((idx >= queue_size) || (chain.size() == queue_size))
+                return;
+
+            chain.push_back(&desc[idx]);
+
+            if (!(desc[idx].flags & VBLK_DESC_NEXT))
+                break;
+
+            idx = desc[idx].next;
+        }
+
+        const vblk_desc_t* st = chain.back();
+
+        if ((chain.size() < 2) || !(st->flags & VBLK_DESC_WRITE) || !st->len)
+            return;
+
+        req.status = hv2_mmu_get_dma_ptr(cpu, st->addr, 1);
+
+        if (!req.status)
+            return;
+
+        const vblk_desc_t* hd = chain.front();
+
+        if ((hd->len < sizeof(vblk_req_hdr_t)) || (hd->flags & VBLK_DESC_WRITE))
+            return;
+
+        if (!hv2_mmu_dma_read(cpu, hd->addr, &req.hdr, sizeof(vblk_req_hdr_t)))
+            return;
+
+        bool device_writes = (req.hdr.type == VBLK_T_IN) || (req.hdr.type == VBLK_T_GET_ID);
+
+        for (size_t i = 1; i < chain.size() - 1; i++) {
+            const vblk_desc_t* d = chain[i];
+
+            if (device_writes != (bool)(d->flags & VBLK_DESC_WRITE))
+                return;
+
+            uint8_t* ptr = hv2_mmu_get_dma_ptr(cpu, d->addr, d->len);
+
+            if (!ptr)
+                return;
+
+            req.data.push_back({ ptr, d->len });
+        }
+
+        req.valid = true;
+    }
+
+    // Move data between the image and a request's buffers. Buffers
+    // made of whole sectors are transferred in place, anything else
+    // goes through the bounce buffer
+    bool vblk_transfer(request_t& req, bool write) {
+        uint64_t bytes = 0;
+        bool aligned = true;
+
+        for (const segment_t& seg : req.data) {
+            bytes += seg.size;
+            aligned &= !(seg.size % VBLK_SECTOR_SIZE);
+        }
+
+        if (bytes % VBLK_SECTOR_SIZE)
+            return false;
+
+        uint64_t sector = req.hdr.sector;
+        uint64_t count = bytes / VBLK_SECTOR_SIZE;
+
+        if (!blk.in_range(sector, count))
+            return false;
+
+        if (aligned) {
+            for (const segment_t& seg : req.data) {
+                uint64_t n = seg.size / VBLK_SECTOR_SIZE;
+
+                bool ok = write ? blk.write(sector, seg.ptr, seg.size) : blk.read(sector, n, seg.ptr);
+
+                if (!ok)
+                    return false;
+
+                sector += n;
+            }
+        } else {
+            bounce.resize(bytes);
+
+            if (!write && !blk.read(sector, count, bounce.data()))
+                return false;
+
+            uint8_t* ptr = bounce.data();
+
+            for (const segment_t& seg : req.data) {
+                if (write) {
+                    std::memcpy(ptr, seg.ptr, seg.size);
+                } else {
+                    std::memcpy(seg.ptr, ptr, seg.size);
+                }
+
+                ptr += seg.size;
+            }
+
+            if (write && !blk.write(sector, bounce.data(), bytes))
+                return false;
+        }
+
+        if (!write)
+            req.written = bytes;
+
+        return true;
+    }
+
+    // Called from the worker thread, must only touch the batch
+    // and the block device
+    void vblk_run_batch() {
+        for (request_t& req : batch) {
+            if (!req.valid)
+                continue;
+
+            switch (req.hdr.type) {
+                case VBLK_T_IN: {
+                    req.result = vblk_transfer(req, false) ? VBLK_S_OK : VBLK_S_IOERR;
+                } break;
+
+                case VBLK_T_OUT: {
+                    req.result = vblk_transfer(req, true) ? VBLK_S_OK : VBLK_S_IOERR;
+                } break;
+
+                case VBLK_T_FLUSH: {
+                    req.result = blk.flush() ? VBLK_S_OK : VBLK_S_IOERR;
+                } break;
+
+                case VBLK_T_GET_ID: {
+                    static const char id[VBLK_ID_BYTES] = "hv2-vblk";
+
+                    uint32_t left = VBLK_ID_BYTES;
+
+                    for (const segment_t& seg : req.data) {
+                        uint32_t n = std::min(seg.size, left);
+
+                        std::memcpy(seg.ptr, id + (VBLK_ID_BYTES - left), n);
+
+                        left -= n;
+                        req.written += n;
+                    }
+
+                    req.result = VBLK_S_OK;
+                } break;
+
+                default: {
+                    req.result = VBLK_S_UNSUPP;
+                } break;
+            }
+        }
+
+        done.store(true, std::memory_order_release);
+
+        if (cpu && cpu->sched)
+            hv2_sched_notify(cpu->sched);
+    }
+
+    static void vblk_job(void* udata) {
+        ((io_device_vblk_t*)udata)->vblk_run_batch();
+    }
+
+    // Collect every newly available request and hand the batch
+    // to the worker, runs on the emulation thread
+    void vblk_notify() {
+        if (!(status & VBLK_STATUS_DRIVER_OK) || (status & VBLK_STATUS_FAILED))
+            return;
+
+        if (busy) {
+            kick_pending = true;
+
+            return;
+        }
+
+        // avail[1] is the index the guest will write next
+        uint16_t idx = avail[1];
+
+        batch.clear();
+
+        while (last_avail != idx) {
+            request_t req;
+
+            req.head = avail[2 + (last_avail & (queue_size - 1))];
+
+            vblk_parse_request(req);
+
+            batch.push_back(std::move(req));
+
+            last_avail++;
+        }
+
+        if (batch.empty())
+            return;
+
+        busy = true;
+        batch_generation = generation;
+
+        workers.submit(vblk_job, this);
+    }
+
+    void vblk_write_status(uint32_t value) {
+        if (!value) {
+            vblk_reset();
+
+            return;
+        }
+
+        if ((value & VBLK_STATUS_DRIVER_OK) && !(status & VBLK_STATUS_DRIVER_OK))
+            if (!vblk_setup_queue())
+                value |= VBLK_STATUS_FAILED;
+
+        status = value;
+    }
+
+public:
+    // Cheap enough to check after every instruction
+    bool has_completions() {
+        return done.load(std::memory_order_acquire);
+    }
+
+    // Post the finished batch to the used ring, one interrupt per batch
+    void complete_io() {
+        done.store(false, std::memory_order_relaxed);
+
+        busy = false;
+
+        // The guest might have reset the device while we were busy,
+        // and maybe set up new rings already. Drop the stale batch, a
+        // doorbell rung on the new rings still has to be served
+        if (!used || (batch_generation != generation)) {
+            batch.clear();
+
+            if (kick_pending) {
+                kick_pending = false;
+
+                vblk_notify();
+            }
+
+            return;
+        }
+
+        vblk_used_elem_t* ring = (vblk_used_elem_t*)(used + 2);
+
+        for (const request_t& req : batch) {
+            if (req.status)
+                *req.status = req.result;
+
+            uint16_t idx = used[1];
+
+            ring[idx & (queue_size - 1)] = { req.head, req.written + (req.status ? 1u : 0u) };
+
+            used[1] = idx + 1;
+        }
+
+        batch.clear();
+
+        vblk_raise_irq();
+
+        if (kick_pending) {
+            kick_pending = false;
+
+            vblk_notify();
+        }
+    }
+
+    bool attach(const std::string& path) {
+        return blk.open(path, VBLK_SECTOR_SIZE);
+    }
+
+    block_dev_t* get_block_dev() {
+        return &blk;
+    }
+
+    // Finish the batch in flight and write cached sectors back
+    void shutdown() {
+        workers.stop();
+
+        blk.flush();
+    }
+
+    io_device_port_list_t* get_port_list() override {
+        return &ports;
+    }
+
+    pci_desc_t get_pci_desc() {
+        return {
+            0x0001,
+            0x4856,  // hv2
+            0x0000,
+            0x00ff,
+            0x0001,    // Mass-storage Device
+            0x0080,    // Other
+            0x0000,
+            0x0001,    // Rev. 1
+            0x0000,
+            0x0000,    // Header Type 0
+            0x0000,
+            0x0000,
+            PCI_IO_BAR(base), // Registers
+            0x00000000,
+            0x00000000,
+            0x00000000,
+            0x00000000,
+            0x00000000,
+            // BAR sizes:
+            { VBLK_SIZE, 0, 0, 0, 0, 0 }
+        };
+    }
+
+    uint32_t read(uint32_t port, int size) override {
+        uint64_t capacity = blk.size();
+
+        switch (port - base) {
+            case VBLK_REG_CAPACITY_LO: return capacity & 0xffffffff;
+            case VBLK_REG_CAPACITY_HI: return capacity >> 32;
+            case VBLK_REG_QUEUE_MAX  : return VBLK_QUEUE_MAX;
+            case VBLK_REG_QUEUE_SIZE : return queue_size;
+            case VBLK_REG_QUEUE_DESC : return queue_desc;
+            case VBLK_REG_QUEUE_AVAIL: return queue_avail;
+            case VBLK_REG_QUEUE_USED : return queue_used;
+            case VBLK_REG_STATUS     : return status;
+            case VBLK_REG_ISR: {
+                uint32_t value = isr;
+
+                isr = 0;
+
+                return value;
+            }
+        }
+
+        return 0;
+    }
+
+    void write(uint32_t port, uint32_t value, int size) override {
+        // The queue can't be moved while it's live
+        bool live = status & VBLK_STATUS_DRIVER_OK;
+
+        switch (port - base) {
+            case VBLK_REG_QUEUE_SIZE : { if (!live) queue_size = value; } break;
+            case VBLK_REG_QUEUE_DESC : { if (!live) queue_desc = value; } break;
+            case VBLK_REG_QUEUE_AVAIL: { if (!live) queue_avail = value; } break;
+            case VBLK_REG_QUEUE_USED : { if (!live) queue_used = value; } break;
+            case VBLK_REG_STATUS     : { vblk_write_status(value); } break;
+            case VBLK_REG_NOTIFY     : { vblk_notify(); } break;
+        }
+    }
+
+    void init(hv2_t* cpu, io_device_pic_t* pic) {
+        this->cpu = cpu;
+        this->pic = pic;
+
+        for (uint16_t p = 0; p < VBLK_SIZE; p++)
+            ports.push_back(base + p);
+
+        workers.init(1);
+    }
+};
@@ -0,0 +1,227 @@
+#pragma once
+
+#include <algorithm>
+#include <string>
+#include <cstdint>
+#include <cstdio>
+
+#include "io_device.hpp"
+#include "pci_device.hpp"
+#include "hv2/hv2.hpp"
+#include "hv2/mmu.hpp"
+
+#define VCON_BASE 0xc140
+#define VCON_SIZE 0x20
+
+#define VCON_RING_MAX 0x100000
+
+/*
+    Paravirtual console. The guest copies text into a byte ring in
+    its own memory and writes the new producer index to NOTIFY, the
+    host then writes everything between TAIL and the new head to the
+    output in (at most) two fwrites. Draining is synchronous, TAIL
+    always equals HEAD once the NOTIFY write returns.
+
+    Registers (32-bit):
+*/
+#define VCON_REG_RING_BASE 0x00 // RW - Ring physical address
+#define VCON_REG_RING_SIZE 0x04 // RW - Ring size in bytes, power of 2
+#define VCON_REG_HEAD      0x08 // R  - Producer index, free-running
+#define VCON_REG_TAIL      0x0c // R  - Consumer index, free-running
+#define VCON_REG_NOTIFY    0x10 // W  - New producer index, drains the ring
+#define VCON_REG_STATUS    0x14 // RW - Status, write 1s to clear error bits
+
+#define VCON_STATUS_READY   0x00000001 // Ring is valid
+#define VCON_STATUS_OVERRUN 0x00000002 // Head moved more than a ring ahead
+#define VCON_STATUS_BADRING 0x00000004 // Ring is outside of guest memory
+
+class io_device_vcon_t : public io_device_t {
+    hv2_t* cpu = nullptr;
+
+    io_device_port_list_t ports;
+
+    uint16_t base = VCON_BASE;
+
+    uint32_t ring_base = 0;
+    uint32_t ring_size = 0;
+    uint32_t head = 0;
+    uint32_t tail = 0;
+    uint32_t status = 0;
+
+    // Host view of the ring, resolved when base or size change
+    uint8_t* ring = nullptr;
+
+    FILE* out = stdout;
+    bool pipe = false;
+
+    void vcon_setup_ring() {
+        ring = nullptr;
+        head = 0;
+        tail = 0;
+
+        status &= ~(VCON_STATUS_READY | VCON_STATUS_BADRING);
+
+        if (!ring_size)
+            return;
+
+        if ((ring_size > VCON_RING_MAX) || (ring_size & (ring_size - 1))) {
+            status |= VCON_STATUS_BADRING;
+
+            return;
+        }
+
+        ring = hv2_mmu_get_dma_ptr(cpu, ring_base, ring_size);
+
+        status |= ring ? VCON_STATUS_READY : VCON_STATUS_BADRING;
+    }
+
+    void vcon_notify(uint32_t value) {
+        if (!ring)
+            return;
+
+        head = value;
+
+        uint32_t pending = head - tail;
+
+        // The guest lapped us, whatever is in the ring is garbage
+        if (pending > ring_size) {
+            status |= VCON_STATUS_OVERRUN;
+
+            tail = head;
+
+            return;
+        }
+
+        uint32_t mask = ring_size - 1;
+        uint32_t start = tail & mask;
+        uint32_t first = std::min(pending, ring_size - start);
+
+        std::fwrite(ring + start, 1, first, out);
+
+        if (pending > first)
+            std::fwrite(ring, 1, pending - first, out);
+
+        std::fflush(out);
+
+        tail = head;
+    }
+
+public:
+    ~io_device_vcon_t() {
+        close();
+    }
+
+    /**
+     * @brief Select where console output goes
+     *
+     * @param target "-" for stdout, "|command" to pipe into a
+     *        command, anything else is a file to write to
+     * @return true on success
+     */
+    bool open(const std::string& target) {
+        close();
+
+        if (target.empty() || (target == "-"))
+            return true;
+
+        if (target[0] == '|') {
+#ifdef _WIN32
+            FILE* file = _popen(target.c_str() + 1, "w");
+#else
+            FILE* file = popen(target.c_str() + 1, "w");
+#endif
+
+            if (!file)
+                return false;
+
+            out = file;
+            pipe = true;
+
+            return true;
+        }
+
+        FILE* file = std::fopen(target.c_str(), "wb");
+
+        if (!file)
+            return false;
+
+        out = file;
+
+        return true;
+    }
+
+    void close() {
+        if (out == stdout)
+            return;
+
+        if (pipe) {
+#ifdef _WIN32
+            _pclose(out);
+#else
+            pclose(out);
+#endif
+        } else {
+            std::fclose(out);
+        }
+
+        out = stdout;
+        pipe = false;
+    }
+
+    io_device_port_list_t* get_port_list() override {
+        return &ports;
+    }
+
+    pci_desc_t get_pci_desc() {
+        return {
+            0x0002,
+            0x4856,  // hv2
+            0x0000,
+            0x00ff,
+            0x0007,    // Simple Communication Controller
+            0x0080,    // Other
+            0x0000,
+            0x0001,    // Rev. 1
+            0x0000,
+            0x0000,    // Header Type 0
+            0x0000,
+            0x0000,
+            PCI_IO_BAR(base), // Registers
+            0x00000000,
+            0x00000000,
+            0x00000000,
+            0x00000000,
+            0x00000000,
+            // BAR sizes:
+            { VCON_SIZE, 0, 0, 0, 0, 0 }
+        };
+    }
+
+    uint32_t read(uint32_t port, int size) override {
+        switch (port - base) {
+            case VCON_REG_RING_BASE: return ring_base;
+            case VCON_REG_RING_SIZE: return ring_size;
+            case VCON_REG_HEAD     : return head;
+            case VCON_REG_TAIL     : return tail;
+            case VCON_REG_STATUS   : return status;
+        }
+
+        return 0;
+    }
+
+    void write(uint32_t port, uint32_t value, int size) override {
+        switch (port - base) {
+            case VCON_REG_RING_BASE: { ring_base = value; vcon_setup_ring(); } break;
+            case VCON_REG_RING_SIZE: { ring_size = value; vcon_setup_ring(); } break;
+            case VCON_REG_NOTIFY   : { vcon_notify(value); } break;
+            case VCON_REG_STATUS   : { status &= ~(value & VCON_STATUS_OVERRUN); } break;
+        }
+    }
+
+    void init(hv2_t* cpu) {
+        this->cpu = cpu;
+
+        for (uint16_t p = 0; p < VCON_SIZE; p++)
+            ports.push_back(base + p);
+    }
+};
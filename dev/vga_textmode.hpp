@@ -3,10 +3,11 @@
 #include <fstream>
 #include <vector>
 #include <cstdio>
+#include <cstring>
 #include <string>
 
 #include "hv2/mmu_device.hpp"
-#include "hv2/clock.hpp"
+#include "hv2/sched.hpp"
 
 #include "pci_device.hpp"
 #include "io_device.hpp"
@@ -14,6 +15,14 @@
 #define WIDTH 80
 #define HEIGHT 25
 #define CELL_SIZE sizeof(uint16_t)
+#define TEXT_SIZE (WIDTH * HEIGHT * CELL_SIZE)
+
+// Control registers, mapped right after VRAM (BAR1)
+#define VGA_REGS_SIZE      0x10
+#define VGA_REG_PRESENT    0x0 // W: Frame done, R: Presented frame count
+#define VGA_REG_CTRL       0x4
+
+#define VGA_CTRL_GUEST_PACED 0x00000001
 
 static const uint32_t vga_palette_rgba[] = {
     0x000000ff, 0x0000aaff, 0x00aa00ff, 0x00aaaaff,
@@ -33,7 +42,56 @@ class dev_vga_textmode_t : public hv2_mmio_device_t {
     uint32_t base = 0xb8000;
     uint32_t size = 0x8000;
 
-    hv2_clock_t* clk;
+    // Text rows modified since the last render
+    bool dirty[HEIGHT];
+
+    // Guest frame pacing
+    uint32_t ctrl = 0;
+    uint32_t frames = 0;
+    bool frame_pending = false;
+
+    // Scheduled once per guest frame, right after the instruction
+    // that marked it done
+    hv2_sched_t* sched = nullptr;
+    hv2_event_fn_t present_fn = nullptr;
+    void* present_udata = nullptr;
+
+    uint32_t read_reg(uint32_t reg) {
+        switch (reg) {
+            case VGA_REG_PRESENT: return frames;
+            case VGA_REG_CTRL: return ctrl;
+        }
+
+        return 0;
+    }
+
+    void write_reg(uint32_t reg, uint32_t value) {
+        switch (reg) {
+            case VGA_REG_PRESENT: {
+                // Writing here opts the guest into frame pacing
+                ctrl |= VGA_CTRL_GUEST_PACED;
+
+                frame_pending = true;
+
+                if (sched)
+                    hv2_sched_add(sched, 0, present_fn, present_udata);
+            } break;
+
+            case VGA_REG_CTRL: {
+                ctrl = value & VGA_CTRL_GUEST_PACED;
+            } break;
+        }
+    }
+
+    void mark_dirty(uint32_t offset, int size) {
+        int bytes = (size == HV2_BYTE) ? 1 : ((size == HV2_SHORT) ? 2 : 4);
+
+        uint32_t first = offset / (WIDTH * CELL_SIZE);
+        uint32_t last = (offset + bytes - 1) / (WIDTH * CELL_SIZE);
+
+        for (uint32_t row = first; (row <= last) && (row < HEIGHT); row++)
+            dirty[row] = true;
+    }
 
 public:
     pci_desc_t get_pci_desc() {
@@ -41,7 +99,7 @@ public:
             0x00000000, // i8042 PS/2 Keyboard Controller
             0x00008086, // Intel Corporation
             0x00000000, // Status
-            0x00000000, // Command
+            PCI_CMD_MEM, // Command
             0x00000003, // Display Controller
             0x00000000, // VGA-compatible Controller
             0x00000000, // VGA Controller
@@ -52,11 +110,13 @@ public:
             0x00000000, // CLSIZE
             // BARs:
             PCI_MEM_BAR(base),
+            PCI_MEM_BAR(base + size),
             0x00000000,
             0x00000000,
             0x00000000,
             0x00000000,
-            0x00000000
+            // BAR sizes:
+            { size, VGA_REGS_SIZE, 0, 0, 0, 0 }
         };
     }
 
@@ -90,10 +150,13 @@ public:
     }
 
     hv2_range_t get_physical_range() override {
-        return { base, base + size };
+        return { base, base + size + VGA_REGS_SIZE };
     }
 
     uint32_t read(uint32_t addr, int size) override {
+        if ((addr - base) >= this->size)
+            return read_reg(addr - base - this->size);
+
         uint32_t v = *(uint32_t*)&buf[addr - base];
         
         if (size == HV2_EXEC)
@@ -108,6 +171,14 @@ public:
 
     void write(uint32_t addr, uint32_t value, int size) override {
         //std::printf("RAM write addr=%08x (%08x), value=%08x, size=%u\n", addr, addr - base, value, size);
+        if ((addr - base) >= this->size) {
+            write_reg(addr - base - this->size, value);
+
+            return;
+        }
+
+        mark_dirty(addr - base, size);
+
         switch (size) {
             case HV2_BYTE: { buf[addr - base] = value; } break;
             case HV2_SHORT: { *(uint16_t*)&buf[addr - base] = value; } break;
@@ -117,57 +188,147 @@ public:
         }
     }
 
-    void render() {
-        uint32_t buf_width = WIDTH * char_width;
+    void set_present_event(hv2_sched_t* sched, hv2_event_fn_t fn, void* udata) {
+        this->sched = sched;
+
+        present_fn = fn;
+        present_udata = udata;
+    }
+
+    bool is_guest_paced() {
+        return ctrl & VGA_CTRL_GUEST_PACED;
+    }
+
+    // Returns true once for every frame the guest marked as done
+    bool consume_frame() {
+        if (!frame_pending)
+            return false;
+
+        frame_pending = false;
+        frames++;
+
+        return true;
+    }
+
+    bool is_row_dirty(int row) {
+        return dirty[row];
+    }
+
+    void mark_all_dirty() {
+        for (int row = 0; row < HEIGHT; row++)
+            dirty[row] = true;
+    }
+
+    int get_text_rows() {
+        return HEIGHT;
+    }
+
+    int get_char_height() {
+        return char_height;
+    }
+
+    /**
+     * @brief Render text rows [first, last) straight into a
+     *        caller-provided RGBA buffer (i.e. a locked texture)
+     *
+     * @param dst Pointer to the top-left pixel of row "first"
+     * @param pitch Length of a pixel row in dst, in bytes
+     * @param first First text row to render
+     * @param last One past the last text row to render
+     */
+    void render_rows(uint32_t* dst, int pitch, int first, int last) {
+        render_rows(buf.data(), dst, pitch, first, last);
+
+        for (int cy = first; cy < last; cy++)
+            dirty[cy] = false;
+    }
+
+    /**
+     * @brief Render text rows from a copy of the text buffer (see
+     *        snapshot), only reads the font so it's safe to call
+     *        from other threads
+     */
+    void render_rows(const uint8_t* cells, uint32_t* dst, int pitch, int first, int last) {
+        for (int cy = first; cy < last; cy++) {
+            uint8_t* row = (uint8_t*)dst + ((cy - first) * char_height * pitch);
 
-        for (int cy = 0; cy < HEIGHT; cy++) {
             for (int cx = 0; cx < WIDTH; cx++) {
                 int bx = cx * char_width;
-                int by = cy * char_height;
 
                 uint32_t vram_offset = (cx * 2) + ((cy * 2) * WIDTH);
-                uint16_t data = *(uint16_t*)&buf[vram_offset];
+                uint16_t data = *(const uint16_t*)&cells[vram_offset];
 
                 uint8_t ch = data & 0xff;
 
-                int fgc = (data >> 8) & 0xf;
-                int bgc = (data >> 12) & 0x7;
+                uint32_t fg = vga_palette_rgba[(data >> 8) & 0xf];
+                uint32_t bg = vga_palette_rgba[(data >> 12) & 0x7];
 
                 uint32_t rom_offset = (ch * char_height);
 
                 for (int y = 0; y < char_height; y++) {
                     uint8_t byte = rom[rom_offset + y];
+                    uint32_t* line = (uint32_t*)(row + (y * pitch)) + bx;
 
-                    for (int x = 0; x < char_width; x++) {
-                        bool fg = (byte << x) & 0x80;
-
-                        screen_buf[(bx + x) + ((y + by) * buf_width)] = fg ? vga_palette_rgba[fgc] : vga_palette_rgba[bgc];
-                    }
+                    for (int x = 0; x < char_width; x++)
+                        line[x] = ((byte << x) & 0x80) ? fg : bg;
                 }
             }
         }
-        // for (int y = 0; y < HEIGHT * char_height; y++) {
-        //     for (int x = 0; x < WIDTH * char_width; x++) {
-        //         int cx = x / char_width;
-        //         int cy = y / char_height;
+    }
+
+    /**
+     * @brief Copy the text buffer and the rows changed since the
+     *        last snapshot or render, then mark everything clean
+     *
+     * @param cells TEXT_SIZE bytes
+     * @param rows HEIGHT flags, set for every changed row
+     * @return true if any row changed
+     */
+    bool snapshot(uint8_t* cells, bool* rows) {
+        bool changed = false;
+
+        std::memcpy(cells, buf.data(), TEXT_SIZE);
+
+        for (int cy = 0; cy < HEIGHT; cy++) {
+            rows[cy] = dirty[cy];
+            changed |= dirty[cy];
+            dirty[cy] = false;
+        }
 
-        //         uint32_t off = (cx * sizeof(uint16_t)) + (cy * sizeof(uint16_t) * WIDTH);
+        return changed;
+    }
 
-        //         uint16_t data = *(uint16_t*)&buf[off];
+    /**
+     * @brief Get the text buffer as plain text, one line per row
+     *        with trailing blanks removed. Characters outside of
+     *        printable ASCII are replaced with '?'
+     */
+    std::string get_text() {
+        std::string text;
 
-        //         uint32_t rom_off = ((data & 0xff) * char_height) + (y % char_height);
+        for (int cy = 0; cy < HEIGHT; cy++) {
+            std::string line;
 
-        //         int b = x % char_width;
+            for (int cx = 0; cx < WIDTH; cx++) {
+                uint8_t ch = buf[(cx * 2) + ((cy * 2) * WIDTH)];
 
-        //         int fgi = (data >> 8) & 0xf;
-        //         int bgi = (data >> 12) & 0x7;
+                if (!ch) {
+                    line.push_back(' ');
+                } else {
+                    line.push_back(((ch >= 0x20) && (ch < 0x7f)) ? ch : '?');
+                }
+            }
 
-        //         uint32_t screen_buf_off = x + (y * WIDTH * char_width);
-        //         bool fg = (rom[rom_off] << b) & 0x80;
+            line.erase(line.find_last_not_of(' ') + 1);
+
+            text += line + "\n";
+        }
 
-        //         screen_buf[screen_buf_off] = fg ? vga_palette_rgba[fgi] : vga_palette_rgba[bgi];
-        //     }
-        // }
+        return text;
+    }
+
+    void render() {
+        render_rows(screen_buf.data(), WIDTH * char_width * sizeof(uint32_t), 0, HEIGHT);
     }
 
     void init_screen_buf() {
@@ -183,5 +344,6 @@ public:
         load_rom(name, char_width, char_height);
 
         init_screen_buf();
+        mark_all_dirty();
     }
 };
\ No newline at end of file
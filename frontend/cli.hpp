@@ -11,7 +11,11 @@ namespace cli {
         SW_HELP,
         SW_STDIN,
         SW_TRACE,
-        SW_WINDOW_FULLSCREEN
+        SW_WINDOW_FULLSCREEN,
+        SW_NO_COMPRESS,
+        SW_UNTHROTTLED,
+        SW_STATS,
+        SW_HEADLESS
     };
 
     enum setting_t {
@@ -25,7 +29,14 @@ namespace cli {
         ST_CPU_SPEED,
         ST_VGA_FONT_ROM,
         ST_VGA_FONT_SIZE,
-        ST_WINDOW_SCALE
+        ST_WINDOW_SCALE,
+        ST_DISK,
+        ST_DISK_OVERLAY,
+        ST_CONVERT_IMAGE,
+        ST_DISK_CACHE,
+        ST_VBLK,
+        ST_CONSOLE,
+        ST_KERNEL
     };
 
     class parser_t {
@@ -48,7 +59,11 @@ namespace cli {
             WSHORTHAND("-d ", "--disassemble"         , SW_DISASSEMBLE        ),
             WSHORTHAND("-t ", "--trace"               , SW_TRACE              ),
             WSHORTHAND("-Wf", "--fullscreen"          , SW_WINDOW_FULLSCREEN  ),
-            LONG_ONLY (       "--stdin"               , SW_STDIN              )
+            LONG_ONLY (       "--stdin"               , SW_STDIN              ),
+            LONG_ONLY (       "--no-compress"         , SW_NO_COMPRESS        ),
+            LONG_ONLY (       "--unthrottled"         , SW_UNTHROTTLED        ),
+            LONG_ONLY (       "--stats"               , SW_STATS              ),
+            LONG_ONLY (       "--headless"            , SW_HEADLESS           )
         };
 
         std::unordered_map <std::string, setting_t> m_settings_map = {
@@ -62,7 +77,14 @@ namespace cli {
             WSHORTHAND("-Vf", "--vga-font-rom"        , ST_VGA_FONT_ROM       ),
             WSHORTHAND("-Vs", "--vga-font-size"       , ST_VGA_FONT_SIZE      ),
             WSHORTHAND("-Ws", "--window-scale"        , ST_WINDOW_SCALE       ),
-            LONG_ONLY (       "--memory-base"         , ST_MEMORY_BASE        )
+            WSHORTHAND("-D" , "--disk"                , ST_DISK               ),
+            WSHORTHAND("-k" , "--kernel"              , ST_KERNEL             ),
+            LONG_ONLY (       "--memory-base"         , ST_MEMORY_BASE        ),
+            LONG_ONLY (       "--disk-overlay"        , ST_DISK_OVERLAY       ),
+            LONG_ONLY (       "--convert-image"       , ST_CONVERT_IMAGE      ),
+            LONG_ONLY (       "--disk-cache"          , ST_DISK_CACHE         ),
+            LONG_ONLY (       "--vblk"                , ST_VBLK               ),
+            LONG_ONLY (       "--console"             , ST_CONSOLE            )
         };
 
 #undef WSHORTHAND
@@ -1,4 +1,4 @@
-#include "hv2/clock.hpp"
+#include "hv2/sched.hpp"
 #include "hv2/hv2.hpp"
 #include "hv2/mmu.hpp"
 #include "hv2/log.hpp"
@@ -12,6 +12,11 @@
 #include "dev/pci.hpp"
 #include "dev/i8042.hpp"
 #include "dev/ata.hpp"
+#include "dev/vblk.hpp"
+#include "dev/vcon.hpp"
+#include "dev/dma.hpp"
+#include "dev/timer.hpp"
+#include "dev/pic.hpp"
 
 #include "elfio/elfio.hpp"
 #include "elfio/elfio_segment.hpp"
@@ -21,43 +26,159 @@
 #include "hv2/disas.hpp"
 
 #include "screen.hpp"
+#include "spsc_queue.hpp"
 
-void hv2f_load_elf_to_guest_memory(std::string name, hv2_t* cpu, dev_ram_t* ram, uint32_t phys_ram_base) {
-    ELFIO::elfio reader;
+// Text buffer copy handed from the emulation thread to the UI thread
+struct hv2f_frame_t {
+    uint8_t cells[TEXT_SIZE];
+    bool dirty[HEIGHT];
+};
+
+// Kernel virtual memory map, see stack.txt
+#define HV2F_KERNEL_LOW_RAM_SIZE 0x400000
+#define HV2F_KERNEL_HIGH_RAM     0xc0000000
+#define HV2F_KERNEL_IO           0x80090000
+#define HV2F_KERNEL_VGA          0x800b8000
+
+#define HV2F_KERNEL_MAP_RWX (MMU_ATTR_READ | MMU_ATTR_WRITE | MMU_ATTR_EXEC)
+#define HV2F_KERNEL_MAP_RW  (MMU_ATTR_READ | MMU_ATTR_WRITE)
+
+// Set up the kernel map the BIOS would, returns the number of entries
+int hv2f_create_kernel_map(hv2_t* cpu, uint32_t ram_base, uint32_t ram_size) {
+    uint32_t low = std::min(ram_size, (uint32_t)HV2F_KERNEL_LOW_RAM_SIZE);
+
+    std::vector <hv2_mmu_entry_t> map = {
+        { ram_base, 0x00000000, low, HV2F_KERNEL_MAP_RWX },
+        { 0x00040000, HV2F_KERNEL_IO, 0x10000, HV2F_KERNEL_MAP_RW },
+        { 0x000b8000, HV2F_KERNEL_VGA, 0x8000, HV2F_KERNEL_MAP_RW }
+    };
+
+    if (ram_size > low)
+        map.push_back({ ram_base + low, HV2F_KERNEL_HIGH_RAM, ram_size - low, HV2F_KERNEL_MAP_RWX });
 
-    reader.load(name);
+    // The kernel map lives in map 1, it's selected on the transition to PL1
+    cpu->cop4_i_cmap = 1;
 
-    uint32_t phys = 0;
+    for (size_t i = 0; i < map.size(); i++)
+        hv2_mmu_create_mapping(cpu, i, map[i]);
+
+    return map.size();
+}
+
+/**
+ * @brief Load a kernel ELF straight into guest RAM and start it the
+ *        way the BIOS would: kernel map set up, MMU enabled and
+ *        running at PL1 from the ELF's entry point
+ *
+ * Segments are placed through the kernel map, so their virtual
+ * addresses must fall in kernel low or high RAM
+ *
+ * @return false if the file can't be loaded or doesn't fit in RAM
+ */
+bool hv2f_load_elf_to_guest_memory(std::string name, hv2_t* cpu, dev_ram_t* ram, uint32_t phys_ram_base) {
+    ELFIO::elfio reader;
+
+    if (!reader.load(name))
+        return false;
 
     std::vector <uint8_t>* buf = ram->get_buf();
 
-    for (int i = 0; i < reader.segments.size(); i++) {
-        hv2_mmu_entry_t me;
+    int entries = hv2f_create_kernel_map(cpu, phys_ram_base, buf->size());
 
+    for (int i = 0; i < reader.segments.size(); i++) {
         const ELFIO::segment* seg = reader.segments[i];
 
-        me.vaddr = seg->get_virtual_address();
-        me.paddr = phys_ram_base + phys;
-        me.size  = seg->get_memory_size();
-        me.attr  = seg->get_flags();
+        if (seg->get_type() != ELFIO::PT_LOAD)
+            continue;
 
+        uint32_t vaddr = seg->get_virtual_address();
+        uint32_t size = seg->get_memory_size();
         uint32_t size_in_file = seg->get_file_size();
 
-        const char* data = seg->get_data();
+        if (size_in_file > size)
+            return false;
+
+        // Find the RAM map the whole segment falls in, only RAM is
+        // mapped executable
+        hv2_mmu_entry_t* me = nullptr;
 
-        for (unsigned t = 0; t < me.size; t++) {
-            int idx = t % size_in_file;
+        for (int e = 0; e < entries; e++) {
+            hv2_mmu_entry_t* m = &cpu->mmu_maps[1][e];
 
-            (*buf)[t + phys] = data[idx];
+            if (!(m->attr & MMU_ATTR_EXEC) || (vaddr < m->vaddr))
+                continue;
+
+            if ((uint64_t)(vaddr - m->vaddr) + size <= m->size) {
+                me = m;
+
+                break;
+            }
         }
 
-        phys += me.size;
+        if (!me) {
+            _hv2_log(error, "Kernel segment at %08x (%u bytes) isn't in kernel RAM", vaddr, size);
 
-        hv2_mmu_create_mapping(cpu, i, me);
+            return false;
+        }
+
+        uint8_t* dst = buf->data() + (hv2_mmu_v2p(me, vaddr) - phys_ram_base);
+
+        std::memcpy(dst, seg->get_data(), size_in_file);
+        std::memset(dst + size_in_file, 0, size - size_in_file);
     }
 
-    // Set PC to ELF entry
+    // BIOS boot steps 4 and 5: enable the MMU and switch to the kernel
+    // map on the transition to PL1
+    cpu->cop4_ctrl = MMU_CTRL_ENABLE_ON_TPL1 | MMU_CTRL_DISABLE_ON_TPL0 | MMU_CTRL_REMAP_ON_PLT;
+
+    hv2_privilege_transition(cpu, 1);
+
+    cpu->r[29] = std::min((uint32_t)buf->size(), (uint32_t)HV2F_KERNEL_LOW_RAM_SIZE);
     cpu->r[31] = reader.get_entry();
+
+    return true;
+}
+
+/**
+ * @brief Render the rows that changed in a frame straight into the
+ *        streaming texture, then present it
+ *
+ * Contiguous runs of dirty text rows are locked as a single band, so
+ * there is no intermediate RGBA frame and no full-frame copy
+ */
+void hv2f_stream_frame(screen_t* screen, dev_vga_textmode_t* vga, hv2f_frame_t* frame) {
+    int rows = vga->get_text_rows();
+    int ch = vga->get_char_height();
+
+    for (int row = 0; row < rows;) {
+        if (!frame->dirty[row]) {
+            row++;
+
+            continue;
+        }
+
+        int last = row + 1;
+
+        while ((last < rows) && frame->dirty[last])
+            last++;
+
+        int pitch;
+
+        uint32_t* pixels = screen_lock(screen, row * ch, (last - row) * ch, &pitch);
+
+        if (pixels) {
+            vga->render_rows(frame->cells, pixels, pitch, row, last);
+
+            screen_unlock(screen);
+        }
+
+        for (int i = row; i < last; i++)
+            frame->dirty[i] = false;
+
+        row = last;
+    }
+
+    screen_present(screen);
 }
 
 dev_ram_t* hv2f_attach_memory(hv2_t* cpu, uint32_t base, uint32_t size) {
@@ -75,6 +196,10 @@ uint32_t hv2f_hrsize_to_bytes(std::string size) {
 
     char unit = size.back();
 
+    // No unit, plain bytes
+    if ((unit >= '0') && (unit <= '9'))
+        return std::stoi(size);
+
     bytes = std::stoi(size.substr(0, size.size() - 1));
 
     switch (unit) {
@@ -148,6 +273,8 @@ void hv2f_disassemble_load_symbols(ELFIO::elfio& elf, hv2_disassembler_t* dis) {
 #include <algorithm> 
 #include <cctype>
 #include <locale>
+#include <csignal>
+#include <thread>
 
 static inline void ltrim(std::string &s) {
     s.erase(s.begin(), std::find_if(s.begin(), s.end(), [](unsigned char ch) {
@@ -206,6 +333,33 @@ void hv2f_disassemble_elf(std::string name) {
     }
 }
 
+int hv2f_convert_image(std::string input, std::string output, bool compress) {
+    block_dev_t src;
+
+    if (!src.open(input, ATA_SECTOR_SIZE, true)) {
+        _hv2_log(error, "Couldn't open disk image \"%s\"", input.c_str());
+
+        return 1;
+    }
+
+    uint64_t stored;
+
+    if (!block_sparse_t::convert(*src.m_backend, output, compress, &stored)) {
+        _hv2_log(error, "Couldn't convert disk image to \"%s\"", output.c_str());
+
+        return 1;
+    }
+
+    uint64_t clusters = (src.m_backend->size() + BLOCK_SPARSE_CLUSTER_SIZE - 1) / BLOCK_SPARSE_CLUSTER_SIZE;
+
+    _hv2_log(info, "Stored %llu of %llu clusters",
+        (unsigned long long)stored,
+        (unsigned long long)clusters
+    );
+
+    return 0;
+}
+
 #include "cli.hpp"
 
 #undef main
@@ -248,7 +402,31 @@ static const char* help_text =
     "  -M, --memory-size <size><kKmMgG>\n"
     "                            Set guest memory size\n"
     "      --memory-base         Set memory physical address\n"
+    "  -k, --kernel <file>       Boot a kernel ELF directly, skipping the\n"
+    "                            BIOS boot process\n"
+    "  -D, --disk <file>         Attach a disk image as the primary master\n"
+    "                            ATA drive\n"
+    "      --disk-overlay <file> Keep disk writes in a copy-on-write overlay,\n"
+    "                            created on top of the --disk image if needed\n"
+    "      --vblk <file>         Attach a disk image to the paravirtual block\n"
+    "                            device\n"
+    "      --console <target>    Send paravirtual console output to stdout (-),\n"
+    "                            a file or a command (|command)\n"
+    "      --disk-cache <size><kKmMgG>\n"
+    "                            Set the disk sector cache size, 0 disables\n"
+    "                            it (default 8M)\n"
     "      --stdin               Get input stream from stdin\n"
+    "      --unthrottled         Run as fast as possible instead of at\n"
+    "                            --cpu-speed, and report the speed reached\n"
+    "      --stats               Print the CPU's performance counters on exit\n"
+    "      --headless            Run without a window, the screen's text is\n"
+    "                            printed on exit and on SIGUSR1\n"
+    "\n"
+    "Disk image options:\n"
+    "      --convert-image <file>\n"
+    "                            Convert the input disk image to a sparse,\n"
+    "                            compressed image\n"
+    "      --no-compress         Store converted clusters uncompressed\n"
     "\n"
     "Disassembler options:\n"
     "  -Sm, --mnemonic-size      Set the maximum length for an instruction's\n"
@@ -266,6 +444,111 @@ static const char* help_text =
     "https://github.com/allkern/hv2/issues";
 
 io_device_i8042_t global_i8042;
+hv2_t* global_stats_cpu = nullptr;
+hv2_sched_t* global_speed_sched = nullptr;
+std::chrono::steady_clock::time_point global_speed_start;
+io_device_ata_t* global_ata = nullptr;
+io_device_vblk_t* global_vblk = nullptr;
+
+void hv2f_log_cache_stats(const char* name, block_dev_t& blk) {
+    if (!blk.is_cached())
+        return;
+
+    block_cache_stats_t stats = blk.get_cache_stats();
+
+    uint64_t total = stats.hits + stats.misses;
+
+    _hv2_log(info, "%s cache: %llu hits, %llu misses (%.1f%% hit rate), %llu lines read ahead, %llu written back",
+        name,
+        (unsigned long long)stats.hits,
+        (unsigned long long)stats.misses,
+        total ? (100.0 * stats.hits / total) : 0.0,
+        (unsigned long long)stats.readahead,
+        (unsigned long long)stats.writebacks
+    );
+}
+
+// Also registered with atexit, cached disk writes must not be lost
+// even if something calls std::exit
+void hv2f_shutdown_disks() {
+    if (global_ata) {
+        global_ata->shutdown();
+
+        for (int i = 0; i < 4; i++) {
+            std::string name = "ATA drive " + std::to_string(i);
+
+            hv2f_log_cache_stats(name.c_str(), global_ata->get_drive(i)->blk);
+        }
+
+        global_ata = nullptr;
+    }
+
+    if (global_vblk) {
+        global_vblk->shutdown();
+
+        hv2f_log_cache_stats("vblk", *global_vblk->get_block_dev());
+
+        global_vblk = nullptr;
+    }
+}
+
+// Also registered with atexit, like hv2f_shutdown_disks
+void hv2f_log_perf_stats() {
+    hv2_t* cpu = global_stats_cpu;
+
+    if (!cpu)
+        return;
+
+    static const char* event_names[HV2_PERF_EVENTS] = {
+        "exceptions",
+        "taken branches",
+        "loads",
+        "stores",
+        "MMU misses",
+        "I/O accesses"
+    };
+
+    _hv2_log(info, "%llu cycles, %llu instructions retired (%.3f IPC)",
+        (unsigned long long)cpu->perf_cycles,
+        (unsigned long long)cpu->perf_instret,
+        cpu->perf_cycles ? ((double)cpu->perf_instret / cpu->perf_cycles) : 0.0
+    );
+
+    for (int i = 0; i < HV2_PERF_EVENTS; i++)
+        _hv2_log(info, "%llu %s", (unsigned long long)cpu->perf_events[i], event_names[i]);
+
+    global_stats_cpu = nullptr;
+}
+
+// Also registered with atexit, reports unthrottled runs' speed
+void hv2f_log_speed() {
+    hv2_sched_t* sched = global_speed_sched;
+
+    if (!sched)
+        return;
+
+    std::chrono::duration <double> elapsed = std::chrono::steady_clock::now() - global_speed_start;
+
+    _hv2_log(info, "Ran %llu cycles in %.3f s (%.2f MHz)",
+        (unsigned long long)sched->now,
+        elapsed.count(),
+        elapsed.count() ? (sched->now / elapsed.count() / 1000000.0) : 0.0
+    );
+
+    global_speed_sched = nullptr;
+}
+
+// Set from the SIGUSR1 handler, headless runs print the screen
+volatile std::sig_atomic_t global_dump_requested = 0;
+
+void hv2f_request_dump(int) {
+    global_dump_requested = 1;
+}
+
+void hv2f_dump_screen(dev_vga_textmode_t* vga) {
+    std::fputs(vga->get_text().c_str(), stdout);
+    std::fflush(stdout);
+}
 
 void global_keydown(uint32_t kcode) {
     std::printf("keycode=%08x\n", kcode);
@@ -273,6 +556,148 @@ void global_keydown(uint32_t kcode) {
     global_i8042.keydown(kcode);
 }
 
+/*
+    The CPU and devices run on the emulation thread, the window lives
+    on the main (UI) thread. They only talk through these queues, so
+    neither side ever waits on the other.
+*/
+struct hv2f_machine_t {
+    hv2_sched_t* sched;
+    dev_vga_textmode_t* vga;
+    io_device_ata_t* ata;
+    io_device_vblk_t* vblk;
+
+    // UI -> emulation
+    spsc_queue_t <uint32_t, 64> keys;
+
+    // Emulation -> UI
+    spsc_queue_t <hv2f_frame_t, 4> frames;
+
+    std::atomic <bool> stop = false;
+    std::atomic <bool> done = false;
+};
+
+// Hand the text rows that changed to the UI thread. If the UI is
+// behind the rows stay dirty and go out with the next frame
+void hv2f_send_frame(hv2f_machine_t* m) {
+    hv2f_frame_t* frame = m->frames.back();
+
+    if (!frame)
+        return;
+
+    if (m->vga->snapshot(frame->cells, frame->dirty))
+        m->frames.push();
+}
+
+// Guests that signal frame completion get exactly one frame per
+// frame, everything else is sent on the periodic refresh
+void hv2f_present_event(void* udata) {
+    hv2f_machine_t* m = (hv2f_machine_t*)udata;
+
+    if (m->vga->consume_frame())
+        hv2f_send_frame(m);
+}
+
+void hv2f_refresh_event(void* udata) {
+    hv2f_machine_t* m = (hv2f_machine_t*)udata;
+
+    if (!m->vga->is_guest_paced())
+        hv2f_send_frame(m);
+}
+
+// Keys posted by the UI thread
+void hv2f_input_watch(void* udata) {
+    hv2f_machine_t* m = (hv2f_machine_t*)udata;
+
+    uint32_t kcode;
+
+    while (m->keys.pop(kcode))
+        global_keydown(kcode);
+}
+
+hv2f_machine_t* global_machine = nullptr;
+
+// Keydown callback, runs on the UI thread
+void hv2f_post_key(uint32_t kcode) {
+    hv2f_machine_t* m = global_machine;
+
+    if (!m->keys.push(kcode)) {
+        _hv2_log(warning, "Input queue full, dropped keycode %08x", kcode);
+
+        return;
+    }
+
+    hv2_sched_notify(m->sched);
+}
+
+// Emulation thread
+void hv2f_run(hv2_t* cpu, hv2f_machine_t* m) {
+    while (!cpu->exit_requested && !m->stop.load(std::memory_order_relaxed))
+        hv2_sched_run(cpu, m->sched);
+
+    m->done.store(true);
+}
+
+/**
+ * @brief Handle window events and present frames until the window
+ *        is closed or the emulation thread is done
+ *
+ * Frames the UI didn't get to in time are merged, only the latest
+ * text is drawn but every row changed since the last present is
+ */
+void hv2f_ui_loop(screen_t* screen, hv2f_machine_t* m) {
+    hv2f_frame_t* ui = new hv2f_frame_t;
+
+    std::memset(ui->dirty, 0, sizeof(ui->dirty));
+
+    while (screen->open && !m->done.load()) {
+        screen_poll_events(screen);
+
+        bool changed = false;
+
+        while (hv2f_frame_t* frame = m->frames.front()) {
+            std::memcpy(ui->cells, frame->cells, TEXT_SIZE);
+
+            for (int i = 0; i < HEIGHT; i++)
+                ui->dirty[i] |= frame->dirty[i];
+
+            m->frames.pop();
+
+            changed = true;
+        }
+
+        // Presenting waits for vsync, otherwise don't spin
+        if (changed) {
+            hv2f_stream_frame(screen, m->vga, ui);
+        } else {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    delete ui;
+}
+
+void hv2f_headless_event(void* udata) {
+    hv2f_machine_t* m = (hv2f_machine_t*)udata;
+
+    if (global_dump_requested) {
+        global_dump_requested = 0;
+
+        hv2f_dump_screen(m->vga);
+    }
+}
+
+// Worker threads notify the scheduler once backing-store I/O is done
+void hv2f_io_watch(void* udata) {
+    hv2f_machine_t* m = (hv2f_machine_t*)udata;
+
+    if (m->ata->has_completions())
+        m->ata->complete_io();
+
+    if (m->vblk->has_completions())
+        m->vblk->complete_io();
+}
+
 int main(int argc, const char* argv[]) {
     _hv2_log::init("hv2");
 
@@ -300,6 +725,14 @@ int main(int argc, const char* argv[]) {
         return 0;
     }
 
+    if (cli.is_set(cli::ST_CONVERT_IMAGE)) {
+        return hv2f_convert_image(
+            cli.get_setting(cli::ST_INPUT),
+            cli.get_setting(cli::ST_CONVERT_IMAGE),
+            !cli.get_switch(cli::SW_NO_COMPRESS)
+        );
+    }
+
     uint32_t memory_base, memory_size;
 
     if (cli.is_set(cli::ST_MEMORY_BASE)) {
@@ -370,31 +803,123 @@ int main(int argc, const char* argv[]) {
 
     io_device_pci_t pci;
     io_device_ata_t ata;
+    io_device_vblk_t vblk;
+    io_device_vcon_t vcon;
+    io_device_dma_t dma;
+    io_device_timer_t timer;
+    io_device_pic_t pic;
 
     pci_device_t i8042_pci;
     pci_device_t vga_pci;
     pci_device_t ata_pci;
+    pci_device_t vblk_pci;
+    pci_device_t vcon_pci;
+    pci_device_t dma_pci;
+    pci_device_t timer_pci;
+    pci_device_t pic_pci;
+
+    pic.init(cpu);
+    global_i8042.init(cpu, &pic);
+    ata.init(cpu, &pic);
+    vblk.init(cpu, &pic);
+    vcon.init(cpu);
+    dma.init(cpu, &pic);
+    timer.init(cpu, &pic, cpu_freq);
+
+    if (cli.is_set(cli::ST_CONSOLE)) {
+        std::string console = cli.get_setting(cli::ST_CONSOLE);
+
+        if (!vcon.open(console))
+            _hv2_log(error, "Couldn't open console output \"%s\"", console.c_str());
+    }
+
+    if (cli.is_set(cli::ST_DISK_CACHE)) {
+        size_t size = hv2f_hrsize_to_bytes(cli.get_setting(cli::ST_DISK_CACHE));
+
+        for (int i = 0; i < 4; i++)
+            ata.get_drive(i)->blk.set_cache(size);
+
+        vblk.get_block_dev()->set_cache(size);
+    }
+
+    if (cli.is_set(cli::ST_DISK)) {
+        std::string disk = cli.get_setting(cli::ST_DISK);
 
-    global_i8042.init(cpu);
-    ata.init();
+        if (cli.is_set(cli::ST_DISK_OVERLAY)) {
+            std::string overlay = cli.get_setting(cli::ST_DISK_OVERLAY);
+
+            if (!ata.attach_overlay(overlay, disk, ATA_PRI_MASTER))
+                _hv2_log(error, "Couldn't open disk overlay \"%s\"", overlay.c_str());
+        } else if (!ata.attach_drive(disk, ATA_PRI_MASTER)) {
+            _hv2_log(error, "Couldn't open disk image \"%s\"", disk.c_str());
+        }
+    }
+
+    if (cli.is_set(cli::ST_VBLK)) {
+        std::string disk = cli.get_setting(cli::ST_VBLK);
+
+        if (!vblk.attach(disk))
+            _hv2_log(error, "Couldn't open disk image \"%s\"", disk.c_str());
+    }
 
     i8042_pci.desc = global_i8042.get_pci_desc();
     vga_pci.desc = vga.get_pci_desc();
     ata_pci.desc = ata.get_pci_desc();
+    vblk_pci.desc = vblk.get_pci_desc();
+    vcon_pci.desc = vcon.get_pci_desc();
+    dma_pci.desc = dma.get_pci_desc();
+    timer_pci.desc = timer.get_pci_desc();
+    pic_pci.desc = pic.get_pci_desc();
+
+    i8042_pci.io_dev = &global_i8042;
+    vga_pci.mmio_dev = &vga;
+    ata_pci.io_dev = &ata;
+    vblk_pci.io_dev = &vblk;
+    vcon_pci.io_dev = &vcon;
+    dma_pci.io_dev = &dma;
+    timer_pci.io_dev = &timer;
+    pic_pci.io_dev = &pic;
 
     pci.register_device(&i8042_pci, 0, 0);
     pci.register_device(&vga_pci, 0, 1);
     pci.register_device(&ata_pci, 0, 4);
+    pci.register_device(&vblk_pci, 0, 5);
+    pci.register_device(&vcon_pci, 0, 6);
+    pci.register_device(&dma_pci, 0, 7);
+    pci.register_device(&timer_pci, 0, 8);
+    pci.register_device(&pic_pci, 0, 9);
 
     io.register_device(&pci);
     io.register_device(&global_i8042);
+    io.register_device(&ata);
+    io.register_device(&vblk);
+    io.register_device(&vcon);
+    io.register_device(&dma);
+    io.register_device(&timer);
+    io.register_device(&pic);
 
     hv2_mmu_attach_device(cpu, &bios_rom);
     hv2_mmu_attach_device(cpu, &bios_ram);
     hv2_mmu_attach_device(cpu, &vga);
     hv2_mmu_attach_device(cpu, &io);
 
-    screen_t* screen = screen_create();
+    if (cli.is_set(cli::ST_KERNEL)) {
+        std::string kernel = cli.get_setting(cli::ST_KERNEL);
+
+        if (!hv2f_load_elf_to_guest_memory(kernel, cpu, ram, memory_base)) {
+            _hv2_log(error, "Couldn't load kernel \"%s\"", kernel.c_str());
+
+            return 1;
+        }
+    }
+
+    bool headless = cli.get_switch(cli::SW_HEADLESS);
+
+#ifdef HV2_NO_SDL
+    headless = true;
+#endif
+
+    screen_t* screen = headless ? nullptr : screen_create();
 
     int scale = 1;
 
@@ -404,24 +929,89 @@ int main(int argc, const char* argv[]) {
 
     bool fullscreen = cli.get_switch(cli::SW_WINDOW_FULLSCREEN);
 
-    screen_init(screen, "VGA screen", vga.get_screen_width(), vga.get_screen_height(), scale, fullscreen);
-    screen_set_keydown_cb(screen, global_keydown);
+    bool unthrottled = cli.get_switch(cli::SW_UNTHROTTLED);
+
+    if (screen) {
+        screen_init(screen, "VGA screen", vga.get_screen_width(), vga.get_screen_height(), scale, fullscreen);
+        screen_set_keydown_cb(screen, hv2f_post_key);
+    }
 
-    hv2_clock_t* screen_clk = hv2_clock_create();
+    hv2_sched_t* sched = hv2_sched_create();
 
-    hv2_clock_init(screen_clk, 60.0, cpu_freq);
+    cpu->sched = sched;
 
-    while (screen->open) {
-        hv2_cycle(cpu);
+    hv2_sched_set_pacing(sched, cpu_freq, !unthrottled);
 
-        if (hv2_clock_tick(screen_clk)) {
-            vga.render();
+    hv2f_machine_t machine = { sched, &vga, &ata, &vblk };
 
-            screen_update(screen, vga.get_screen_buf());
-        }
+    global_machine = &machine;
+
+    if (screen) {
+        vga.set_present_event(sched, hv2f_present_event, &machine);
+
+        hv2_sched_add_periodic(sched, cpu_freq / 60.0, hv2f_refresh_event, &machine);
+        hv2_sched_watch(sched, hv2f_input_watch, &machine);
+    } else {
+#ifdef SIGUSR1
+        std::signal(SIGUSR1, hv2f_request_dump);
+#endif
+
+        hv2_sched_add_periodic(sched, cpu_freq / 10.0, hv2f_headless_event, &machine);
     }
 
-    screen_destroy(screen);
+    hv2_sched_watch(sched, hv2f_io_watch, &machine);
 
-    return 0;
-}
\ No newline at end of file
+    // After the I/O and input watches, so their interrupts are
+    // delivered right away
+    pic.attach(sched);
+
+    global_ata = &ata;
+    global_vblk = &vblk;
+
+    std::atexit(hv2f_shutdown_disks);
+
+    if (unthrottled) {
+        global_speed_sched = sched;
+        global_speed_start = std::chrono::steady_clock::now();
+
+        std::atexit(hv2f_log_speed);
+    }
+
+    if (cli.get_switch(cli::SW_STATS)) {
+        global_stats_cpu = cpu;
+
+        std::atexit(hv2f_log_perf_stats);
+    }
+
+    if (screen) {
+        std::thread emulation(hv2f_run, cpu, &machine);
+
+        hv2f_ui_loop(screen, &machine);
+
+        // Wakes the emulation thread if it's sleeping
+        machine.stop.store(true);
+
+        hv2_sched_notify(sched);
+
+        emulation.join();
+
+        screen_destroy(screen);
+    } else {
+        hv2f_run(cpu, &machine);
+    }
+
+    global_machine = nullptr;
+
+    hv2f_shutdown_disks();
+    hv2f_log_perf_stats();
+    hv2f_log_speed();
+
+    if (!screen)
+        hv2f_dump_screen(&vga);
+
+    cpu->sched = nullptr;
+
+    hv2_sched_destroy(sched);
+
+    return cpu->exit_code;
+}
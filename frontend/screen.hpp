@@ -1,11 +1,33 @@
 #pragma once
 
-#include "SDL.h"
-
 #include <string>
+#include <cstdint>
 
 typedef void (*kevent_t)(uint32_t);
 
+#ifdef HV2_NO_SDL
+// Built without SDL, only headless runs are possible. Nothing here
+// is ever called, it just keeps the frontend building
+struct screen_t {
+    kevent_t keydown_cb = nullptr;
+    kevent_t keyup_cb = nullptr;
+
+    bool open = false;
+
+    int width, height;
+};
+
+inline screen_t* screen_create() { return nullptr; }
+inline void screen_destroy(screen_t*) {}
+inline void screen_init(screen_t*, std::string, int, int, int = 1, bool = false, bool = true) {}
+inline void screen_set_keydown_cb(screen_t*, kevent_t) {}
+inline uint32_t* screen_lock(screen_t*, int, int, int*) { return nullptr; }
+inline void screen_unlock(screen_t*) {}
+inline void screen_poll_events(screen_t*) {}
+inline void screen_present(screen_t*) {}
+#else
+#include "SDL.h"
+
 struct screen_t {
     SDL_Window* window;
     SDL_Renderer* renderer;
@@ -33,7 +55,7 @@ void screen_destroy(screen_t* screen) {
     delete screen;
 }
 
-void screen_init(screen_t* screen, std::string title, int width, int height, int scale = 1, bool fullscreen = false) {
+void screen_init(screen_t* screen, std::string title, int width, int height, int scale = 1, bool fullscreen = false, bool vsync = true) {
     screen->width = width;
     screen->height = height;
 
@@ -47,7 +69,7 @@ void screen_init(screen_t* screen, std::string title, int width, int height, int
     screen->renderer = SDL_CreateRenderer(
         screen->window,
         -1,
-        SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC
+        SDL_RENDERER_ACCELERATED | (vsync ? SDL_RENDERER_PRESENTVSYNC : 0)
     );
 
     screen->texture = SDL_CreateTexture(
@@ -64,11 +86,31 @@ void screen_set_keydown_cb(screen_t* screen, kevent_t cb) {
     screen->keydown_cb = cb;
 }
 
-void screen_update(screen_t* screen, uint32_t* buf) {
-    SDL_UpdateTexture(screen->texture, NULL, buf, screen->width * sizeof(uint32_t));
-    SDL_RenderCopy(screen->renderer, screen->texture, NULL, NULL);
-    SDL_RenderPresent(screen->renderer);
+/**
+ * @brief Lock a band of the streaming texture for direct writing
+ *
+ * @param screen Screen
+ * @param y First pixel row of the band
+ * @param h Height of the band in pixels
+ * @param pitch Returns the length of a locked pixel row in bytes
+ * @return Pointer to the first locked pixel (write-only)
+ */
+uint32_t* screen_lock(screen_t* screen, int y, int h, int* pitch) {
+    SDL_Rect rect = { 0, y, screen->width, h };
+
+    void* pixels;
+
+    if (SDL_LockTexture(screen->texture, &rect, &pixels, pitch))
+        return nullptr;
+
+    return (uint32_t*)pixels;
+}
+
+void screen_unlock(screen_t* screen) {
+    SDL_UnlockTexture(screen->texture);
+}
 
+void screen_poll_events(screen_t* screen) {
     SDL_Event event;
 
     while (SDL_PollEvent(&event)) {
@@ -82,4 +124,12 @@ void screen_update(screen_t* screen, uint32_t* buf) {
             } break;
         }
     }
-}
\ No newline at end of file
+}
+
+void screen_present(screen_t* screen) {
+    SDL_RenderCopy(screen->renderer, screen->texture, NULL, NULL);
+    SDL_RenderPresent(screen->renderer);
+
+    screen_poll_events(screen);
+}
+#endif
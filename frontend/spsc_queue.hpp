@@ -0,0 +1,80 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+/*
+    Lock-free single-producer/single-consumer ring. Exactly one thread
+    pushes and exactly one thread pops, neither ever blocks.
+
+    Items are written and read in place: the producer fills the slot
+    returned by back() and publishes it with push(), the consumer reads
+    front() and hands the slot back with pop().
+*/
+template <typename T, size_t N> class spsc_queue_t {
+    static_assert((N & (N - 1)) == 0, "spsc_queue_t size must be a power of 2");
+
+    T items[N];
+
+    // Each index is only written by one side, keep them on separate
+    // cache lines so the two threads don't fight over them
+    alignas(64) std::atomic <size_t> head = 0; // Consumer
+    alignas(64) std::atomic <size_t> tail = 0; // Producer
+
+public:
+    // Producer: free slot to fill, nullptr if the queue is full
+    T* back() {
+        size_t t = tail.load(std::memory_order_relaxed);
+
+        if ((t - head.load(std::memory_order_acquire)) == N)
+            return nullptr;
+
+        return &items[t & (N - 1)];
+    }
+
+    // Producer: publish the slot returned by back()
+    void push() {
+        tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    bool push(const T& item) {
+        T* slot = back();
+
+        if (!slot)
+            return false;
+
+        *slot = item;
+
+        push();
+
+        return true;
+    }
+
+    // Consumer: oldest item, nullptr if the queue is empty
+    T* front() {
+        size_t h = head.load(std::memory_order_relaxed);
+
+        if (h == tail.load(std::memory_order_acquire))
+            return nullptr;
+
+        return &items[h & (N - 1)];
+    }
+
+    // Consumer: release the slot returned by front()
+    void pop() {
+        head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    bool pop(T& item) {
+        T* slot = front();
+
+        if (!slot)
+            return false;
+
+        item = *slot;
+
+        pop();
+
+        return true;
+    }
+};
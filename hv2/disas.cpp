@@ -65,7 +65,8 @@ std::unordered_map <uint32_t, std::string> sys_op_mnemonic_map = {
     { 3, "tpl2"    },
     { 4, "tpl3"    },
     { 5, "debug"   },
-    { 6, "excep"   }
+    { 6, "excep"   },
+    { 7, "sysret"  }
 };
 
 std::unordered_map <uint32_t, std::string> lsl_op_mnemonic_map = {
@@ -290,6 +291,14 @@ std::string hv2d_disassemble(hv2_disassembler_t* dis, uint32_t opcode) {
 
         // System
         case 0b01111: {
+            // debug 0xffffff
+            if (hv2d_d_sys_op(opcode) == 5 && hv2d_d_sys_imm24(opcode) == 0xffffff) {
+                dis->mnemonic = "wfi";
+                dis->operands = "";
+
+                break;
+            }
+
             dis->mnemonic = sys_op_mnemonic_map[hv2d_d_sys_op(opcode)];
             dis->operands = hv2d_print_integer(dis, "0x%x", hv2d_d_sys_imm24(opcode));
         } break;
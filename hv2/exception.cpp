@@ -6,12 +6,44 @@
 #include <cstdio>
 #include <cstdlib>
 
+static uint32_t hv2_exception_vector(uint32_t cause) {
+    if ((cause & HV2_CAUSE_IRQ_MASK) == HV2_CAUSE_IRQ)
+        return HV2_VEC_IRQ(cause & ~HV2_CAUSE_IRQ_MASK);
+
+    if ((cause & HV2_CAUSE_MASK) == HV2_CAUSE_MMU)
+        return HV2_VEC_MMU;
+
+    // CPU exceptions keep their 24-bit immediate in bits 8 and up,
+    // which can reach into the EXT bits, so check for them first
+    if ((cause & HV2_CAUSE_CPU) && ((cause & 0xff) <= (HV2_CAUSE_INVALID_TPL & 0xff))) {
+        if ((cause & 0xff) == (HV2_CAUSE_SYSCALL & 0xff))
+            return HV2_VEC_SYSCALL;
+
+        return HV2_VEC_CPU;
+    }
+
+    return HV2_VEC_OTHER;
+}
+
 void hv2_exception(hv2_t* cpu, uint32_t cause) {
+    int pl = cpu->pl;
+
     hv2_privilege_up(cpu);
+    hv2_privilege_swap_banks(cpu, pl, cpu->pl);
+
+    cpu->halted = false;
+    cpu->handler_depth++;
+
+    cpu->perf_events[HV2_PERF_EXCEPTION]++;
 
     cpu->cop0_xcause = cause;
     cpu->cop0_xpc = cpu->r[31];
-    cpu->r[31] = cpu->cop0_xhaddr;
+    // Resets always go through xhaddr
+    if ((cpu->cop0_cr0 & HV2_COP0_CR0_XVECTORED) && (cause != HV2_CAUSE_RESET)) {
+        cpu->r[31] = cpu->cop0_xvbase + hv2_exception_vector(cause);
+    } else {
+        cpu->r[31] = cpu->cop0_xhaddr;
+    }
 
     hv2_flush(cpu, 31);
 }
@@ -123,6 +123,22 @@ uint32_t* hv2_get_cop_register(hv2_t* cpu, uint32_t copn, uint32_t copr) {
                 case 2: { return &cpu->cop0_xcause; } break;
                 case 3: { return &cpu->cop0_xhaddr; } break;
                 case 4: { return &cpu->cop0_xpc; } break;
+                case 5: { return &cpu->cop0_xvbase; } break;
+
+                // 64-bit counters, little-endian halves
+                case HV2_COP0_CYCLE_LO  : { return (uint32_t*)&cpu->perf_cycles; } break;
+                case HV2_COP0_CYCLE_HI  : { return (uint32_t*)&cpu->perf_cycles + 1; } break;
+                case HV2_COP0_INSTRET_LO: { return (uint32_t*)&cpu->perf_instret; } break;
+                case HV2_COP0_INSTRET_HI: { return (uint32_t*)&cpu->perf_instret + 1; } break;
+            }
+
+            if ((copr >= HV2_COP0_PERFSEL(0)) && (copr < HV2_COP0_PERFSEL(HV2_PERF_COUNTERS)))
+                return &cpu->perf_sel[copr - HV2_COP0_PERFSEL(0)];
+
+            if ((copr >= HV2_COP0_BANK(0, 0)) && (copr < HV2_COP0_BANK(4, 0))) {
+                uint32_t n = copr - HV2_COP0_BANK(0, 0);
+
+                return &cpu->cop0_bank[n >> 5][n & 31];
             }
         } break;
 
@@ -146,7 +162,49 @@ uint32_t* hv2_get_cop_register(hv2_t* cpu, uint32_t copn, uint32_t copr) {
     return nullptr;
 }
 
+// Selectable counters don't have storage of their own, they're
+// computed from the event they select and a per-counter base
+static bool hv2_perf_counter(uint32_t copn, uint32_t copr) {
+    return !copn && (copr >= HV2_COP0_PERFCNT(0)) && (copr < HV2_COP0_PERFCNT(HV2_PERF_COUNTERS));
+}
+
+static bool hv2_perf_read(hv2_t* cpu, uint32_t copr, uint64_t* value) {
+    uint32_t n = (copr - HV2_COP0_PERFCNT(0)) >> 1;
+    uint32_t sel = cpu->perf_sel[n];
+
+    if (sel >= HV2_PERF_EVENTS)
+        return false;
+
+    *value = cpu->perf_events[sel] - cpu->perf_base[n];
+
+    return true;
+}
+
+static bool hv2_perf_write(hv2_t* cpu, uint32_t copr, uint32_t value) {
+    uint32_t n = (copr - HV2_COP0_PERFCNT(0)) >> 1;
+    uint64_t count;
+
+    if (!hv2_perf_read(cpu, copr, &count))
+        return false;
+
+    int shift = (copr & 1) * 32;
+
+    count &= ~(0xffffffffull << shift);
+    count |= (uint64_t)value << shift;
+
+    cpu->perf_base[n] = cpu->perf_events[cpu->perf_sel[n]] - count;
+
+    return true;
+}
+
 void cpe_mtcr(hv2_t* cpu, uint32_t copn, uint32_t cpur, uint32_t copr) {
+    if (hv2_perf_counter(copn, copr)) {
+        if (!hv2_perf_write(cpu, copr, cpu->r[cpur]))
+            hv2_exception(cpu, HV2_CAUSE_INVALID_COPX);
+
+        return;
+    }
+
     uint32_t* cr = hv2_get_cop_register(cpu, copn, copr);
 
     if (!cr) {
@@ -155,9 +213,28 @@ void cpe_mtcr(hv2_t* cpu, uint32_t copn, uint32_t cpur, uint32_t copr) {
         *cr = cpu->r[cpur];
     }
 
+    // Selecting an event restarts the counter from zero
+    if (!copn && (copr >= HV2_COP0_PERFSEL(0)) && (copr < HV2_COP0_PERFSEL(HV2_PERF_COUNTERS))) {
+        uint32_t n = copr - HV2_COP0_PERFSEL(0);
+
+        if (cpu->perf_sel[n] < HV2_PERF_EVENTS)
+            cpu->perf_base[n] = cpu->perf_events[cpu->perf_sel[n]];
+    }
 }
 
 void cpe_mfcr(hv2_t* cpu, uint32_t copn, uint32_t cpur, uint32_t copr) {
+    if (hv2_perf_counter(copn, copr)) {
+        uint64_t count;
+
+        if (!hv2_perf_read(cpu, copr, &count)) {
+            hv2_exception(cpu, HV2_CAUSE_INVALID_COPX);
+        } else {
+            cpu->r[cpur] = (uint32_t)(count >> ((copr & 1) * 32));
+        }
+
+        return;
+    }
+
     uint32_t* cr = hv2_get_cop_register(cpu, copn, copr);
     
     if (!cr) {
@@ -204,6 +281,10 @@ void hv2_flush(hv2_t* cpu, uint32_t d) {
         cpu->pipeline[0] = 0;
         cpu->pipeline[1] = 0;
         cpu->pipeline[2] = 0;
+
+        cpu->pipeline_valid[0] = false;
+        cpu->pipeline_valid[1] = false;
+        cpu->pipeline_valid[2] = false;
     }
 }
 
@@ -283,6 +364,8 @@ void hv2_execute(hv2_t* cpu) {
 
                 //printf("taken %08x after\n", cpu->r[31]);
 
+                cpu->perf_events[HV2_PERF_BRANCH]++;
+
                 hv2_flush(cpu, 31);
             }
         } break;
@@ -302,6 +385,8 @@ void hv2_execute(hv2_t* cpu) {
                     cpu->r[31] = cpu->r[s1];
                 }
 
+                cpu->perf_events[HV2_PERF_BRANCH]++;
+
                 hv2_flush(cpu, 31);
             }
         } break;
@@ -344,10 +429,26 @@ void hv2_execute(hv2_t* cpu) {
 
                 // debug
                 case 0b101: {
-                    if (c == 0xadc0de) {
+                    if (c == HV2_DEBUG_EXIT) {
                         std::printf("\na0=%08x\n", cpu->r[2]);
 
-                        std::exit(cpu->r[2]);
+                        cpu->exit_requested = true;
+                        cpu->exit_code = cpu->r[2];
+
+                        if (cpu->sched)
+                            hv2_sched_break(cpu->sched);
+
+                        break;
+                    }
+
+                    // wfi: stop fetching until the next exception
+                    if (c == HV2_DEBUG_WFI) {
+                        cpu->halted = true;
+
+                        if (cpu->sched)
+                            hv2_sched_break(cpu->sched);
+
+                        break;
                     }
 
                     hv2_exception(cpu, HV2_CAUSE_DEBUG | (c << 8));
@@ -360,9 +461,20 @@ void hv2_execute(hv2_t* cpu) {
 
                 // sysret
                 default: {
+                    int pl = cpu->pl;
+
                     hv2_privilege_down(cpu);
+                    hv2_privilege_swap_banks(cpu, pl, cpu->pl);
 
                     cpu->r[31] = cpu->cop0_xpc;
+
+                    if (cpu->handler_depth)
+                        cpu->handler_depth--;
+
+                    // Interrupts held back while the handler ran can
+                    // be delivered now
+                    if (cpu->sched)
+                        hv2_sched_kick(cpu->sched);
                 } break;
             } 
         } break;
@@ -429,6 +541,8 @@ void hv2_execute(hv2_t* cpu) {
             switch (hv2_d_lsl_op(opcode)) {
                 // Load
                 case 0: {
+                    cpu->perf_events[HV2_PERF_LOAD]++;
+
                     cpu->r[d] = hv2_mmu_read(cpu, addr, size);
 
                     hv2_flush(cpu, d);
@@ -436,6 +550,8 @@ void hv2_execute(hv2_t* cpu) {
 
                 // Store
                 case 1: {
+                    cpu->perf_events[HV2_PERF_STORE]++;
+
                     hv2_mmu_write(cpu, addr, cpu->r[d], size);
                 } break;
 
@@ -541,10 +657,21 @@ void hv2d_load_symbols(ELFIO::elfio& elf, hv2_disassembler_t* dis) {
 }
 
 void hv2_cycle(hv2_t* cpu) {
+    uint32_t pc = cpu->r[31];
+
     cpu->pipeline[2] = cpu->pipeline[1];
     cpu->pipeline[1] = cpu->pipeline[0];
+    cpu->pipeline_valid[2] = cpu->pipeline_valid[1];
+    cpu->pipeline_valid[1] = cpu->pipeline_valid[0];
+
     cpu->pipeline[0] = hv2_mmu_read(cpu, cpu->r[31], HV2_EXEC);
 
+    // A faulting fetch jumps to the handler, nothing was fetched
+    cpu->pipeline_valid[0] = cpu->r[31] == pc;
+
+    cpu->perf_cycles++;
+    cpu->perf_instret += cpu->pipeline_valid[2];
+
     if (cpu->internal_trace) {
         ELFIO::elfio elf;
 
@@ -5,7 +5,7 @@
 #include <array>
 
 #include "mmu.hpp"
-#include "clock.hpp"
+#include "sched.hpp"
 
 #define HV2_PIPELINE_SIZE 3
 
@@ -27,10 +27,53 @@
 #define HV2_CAUSE_EXT             0xff000000
 #define HV2_CAUSE_RESET           (HV2_CAUSE_EXT | 0x485632)
 
+// External interrupts, the low 5 bits are the interrupt line
+#define HV2_CAUSE_IRQ             0xd0000000
+#define HV2_CAUSE_IRQ_MASK        0xffffffe0
+
+// debug immediates handled by the CPU itself
+#define HV2_DEBUG_EXIT            0xadc0de
+#define HV2_DEBUG_WFI             0xffffff
+
 #define HV2_COP0_CR0_XSTACKED_ISR    0x00000001
 #define HV2_COP0_CR0_XFLUSH_ON_IRQ   0x00000002
 #define HV2_COP0_CR0_XSTALL_ACCESS   0x00000004
 #define HV2_COP0_CR0_XFLUSH_ON_FT    0x00000008
+#define HV2_COP0_CR0_XVECTORED       0x00000010
+
+// Registers swapped by XSTACKED_ISR, r0 and pc are shared
+#define HV2_BANK_FIRST 1
+#define HV2_BANK_LAST  30
+
+// COP0 register for bank pl, register n
+#define HV2_COP0_BANK(pl, n) (0x20 + ((pl) * 32) + (n))
+
+// Performance counter events
+#define HV2_PERF_EXCEPTION 0 // Exceptions and interrupts taken
+#define HV2_PERF_BRANCH    1 // Taken branches
+#define HV2_PERF_LOAD      2
+#define HV2_PERF_STORE     3
+#define HV2_PERF_MMU_MISS  4 // Translations with no matching map
+#define HV2_PERF_IO        5 // Loads and stores to I/O space
+#define HV2_PERF_EVENTS    6
+
+#define HV2_PERF_COUNTERS  4
+
+// COP0 performance counter registers, 64-bit counters are split
+// into low and high halves
+#define HV2_COP0_CYCLE_LO   8
+#define HV2_COP0_CYCLE_HI   9
+#define HV2_COP0_INSTRET_LO 10
+#define HV2_COP0_INSTRET_HI 11
+#define HV2_COP0_PERFSEL(n) (12 + (n))       // Event counted by counter n
+#define HV2_COP0_PERFCNT(n) (16 + ((n) * 2)) // Counter n, low half first
+
+// Vector table slots, relative to cop0_xvbase
+#define HV2_VEC_SYSCALL 0x000
+#define HV2_VEC_CPU     0x010
+#define HV2_VEC_MMU     0x020
+#define HV2_VEC_OTHER   0x030
+#define HV2_VEC_IRQ(n)  (0x040 + ((n) * 0x10))
 
 struct hv2_t {
     uint32_t r[32] = { 0 };
@@ -39,16 +82,47 @@ struct hv2_t {
     
     uint32_t pipeline[3] = { 0x00000000 };
 
+    // Slot holds a fetched instruction, cleared when it's flushed.
+    // Only valid slots count as retired
+    bool pipeline_valid[3] = { false };
+
     int pl = 0;
 
     bool flush_pending = false;
 
+    // Waiting for an interrupt (wfi), cleared by hv2_exception
+    bool halted = false;
+
+    // Exception handlers currently running, hv2_exception enters one
+    // and sysret leaves it. Nested handlers count separately, so an
+    // inner sysret doesn't make the outer handler look finished
+    uint32_t handler_depth = 0;
+
+    // Set by debug 0xadc0de, the frontend stops running the CPU
+    bool exit_requested = false;
+    uint32_t exit_code = 0;
+
     // COP0
     uint32_t cop0_cr0 = 0;
     uint32_t cop0_cr1 = 0;
     uint32_t cop0_xpc = 0;
     uint32_t cop0_xcause = 0;
     uint32_t cop0_xhaddr = 0;
+    uint32_t cop0_xvbase = 0;
+
+    // Shadow register files, one per privilege level. The current
+    // level's registers live in r, its bank is only written on the
+    // way out
+    uint32_t cop0_bank[4][32] = { { 0 } };
+
+    // Performance counters. Selectable counter n reads as
+    // perf_events[perf_sel[n]] - perf_base[n], so guest writes only
+    // move its base and never touch the shared event counts
+    uint64_t perf_cycles = 0;
+    uint64_t perf_instret = 0;
+    uint64_t perf_events[HV2_PERF_EVENTS] = { 0 };
+    uint32_t perf_sel[HV2_PERF_COUNTERS] = { 0 };
+    uint64_t perf_base[HV2_PERF_COUNTERS] = { 0 };
 
     // COP4 (MMU)
     std::vector <hv2_mmio_device_t*> mmu_devices;
@@ -69,6 +143,9 @@ struct hv2_t {
     bool internal_trace_elf = false;
 
     float clk_freq;
+
+    // Device event scheduler, set up by the frontend
+    hv2_sched_t* sched = nullptr;
 };
 
 hv2_t* hv2_create();
@@ -2,6 +2,8 @@
 #include "hv2.hpp"
 #include "exception.hpp"
 
+#include <cstring>
+
 hv2_mmu_entry_t* hv2_mmu_search_map(hv2_t* cpu, uint32_t vaddr) {
     hv2_t::mmu_map_t map = cpu->mmu_maps[cpu->cop4_i_cmap];
 
@@ -24,6 +26,9 @@ uint32_t hv2_mmu_v2p(hv2_mmu_entry_t* me, uint32_t vaddr) {
 
 hv2_mmio_device_t* hv2_mmu_get_device_at_phys(hv2_t* cpu, uint32_t paddr) {
     for (hv2_mmio_device_t* dev : cpu->mmu_devices) {
+        if (!dev->decode)
+            continue;
+
         // Get this device's physical memory range
         hv2_range_t range = dev->get_physical_range();
 
@@ -51,6 +56,8 @@ uint32_t hv2_mmu_get_phys(hv2_t* cpu, uint32_t addr, int size) {
         hv2_mmu_entry_t* me = hv2_mmu_search_map(cpu, addr);
 
         if (!me) {
+            cpu->perf_events[HV2_PERF_MMU_MISS]++;
+
             hv2_exception(cpu, HV2_CAUSE_MMU_NOMAP);
 
             return 0x00000000;
@@ -101,6 +108,10 @@ uint32_t hv2_mmu_read(hv2_t* cpu, uint32_t addr, int size) {
 
         return 0x00000000;
     }
+
+    if (dev->io_space && (size != HV2_EXEC))
+        cpu->perf_events[HV2_PERF_IO]++;
+
         //std::printf("MMU read virt=%08x, phys=%08x, return=%08x\n", addr, phys, dev->read(phys, size));
 
     return dev->read(phys, size);
@@ -120,6 +131,9 @@ void hv2_mmu_write(hv2_t* cpu, uint32_t addr, uint32_t value, int size) {
         return;
     }
 
+    if (dev->io_space)
+        cpu->perf_events[HV2_PERF_IO]++;
+
     dev->write(phys, value, size);
 }
 
@@ -129,4 +143,90 @@ void hv2_mmu_attach_device(hv2_t* cpu, hv2_mmio_device_t* dev) {
 
 void hv2_mmu_create_mapping(hv2_t* cpu, int idx, const hv2_mmu_entry_t& me) {
     cpu->mmu_maps[cpu->cop4_i_cmap][idx] = me;
+}
+
+/**
+ * @brief Get a host pointer to a physical memory range,
+ *        used by bus-mastering devices
+ * 
+ * @param cpu HV2 core
+ * @param paddr Physical address
+ * @param size Size of the range in bytes
+ * @return Host pointer, nullptr if the range isn't backed by memory
+ */
+uint8_t* hv2_mmu_get_dma_ptr(hv2_t* cpu, uint32_t paddr, uint32_t size) {
+    hv2_mmio_device_t* dev = hv2_mmu_get_device_at_phys(cpu, paddr);
+
+    if (!dev)
+        return nullptr;
+
+    return dev->get_dma_ptr(paddr, size);
+}
+
+// Bus masters never reach I/O space, port accesses have side effects
+// (reads clear status, consume data) a memory access must not have
+static bool hv2_mmu_dma_range_ok(hv2_t* cpu, uint32_t paddr, uint32_t size) {
+    for (uint32_t i = 0; i < size; i++) {
+        hv2_mmio_device_t* dev = hv2_mmu_get_device_at_phys(cpu, paddr + i);
+
+        if (!dev || dev->io_space)
+            return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Copy from guest physical memory, falls back to byte-wise
+ *        device reads if the range isn't backed by memory
+ * 
+ * @return false if anything in the range is unmapped or in I/O space
+ */
+bool hv2_mmu_dma_read(hv2_t* cpu, uint32_t paddr, void* dst, uint32_t size) {
+    uint8_t* ptr = hv2_mmu_get_dma_ptr(cpu, paddr, size);
+
+    if (ptr) {
+        std::memcpy(dst, ptr, size);
+
+        return true;
+    }
+
+    if (!hv2_mmu_dma_range_ok(cpu, paddr, size))
+        return false;
+
+    for (uint32_t i = 0; i < size; i++) {
+        hv2_mmio_device_t* dev = hv2_mmu_get_device_at_phys(cpu, paddr + i);
+
+        ((uint8_t*)dst)[i] = dev->read(paddr + i, HV2_BYTE);
+    }
+
+    return true;
+}
+
+/**
+ * @brief Copy to guest physical memory, falls back to byte-wise
+ *        device writes if the range isn't backed by memory
+ * 
+ * @return false if anything in the range is unmapped or in I/O space
+ */
+bool hv2_mmu_dma_write(hv2_t* cpu, uint32_t paddr, const void* src, uint32_t size) {
+    uint8_t* ptr = hv2_mmu_get_dma_ptr(cpu, paddr, size);
+
+    if (ptr) {
+        std::memcpy(ptr, src, size);
+
+        return true;
+    }
+
+    // A DMA engine writing its own registers would start itself again
+    if (!hv2_mmu_dma_range_ok(cpu, paddr, size))
+        return false;
+
+    for (uint32_t i = 0; i < size; i++) {
+        hv2_mmio_device_t* dev = hv2_mmu_get_device_at_phys(cpu, paddr + i);
+
+        dev->write(paddr + i, ((const uint8_t*)src)[i], HV2_BYTE);
+    }
+
+    return true;
 }
\ No newline at end of file
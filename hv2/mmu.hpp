@@ -38,4 +38,7 @@ uint32_t hv2_mmu_v2p(hv2_mmu_entry_t*, uint32_t);
 hv2_mmio_device_t* hv2_mmu_get_device_at_phys(hv2_t*, uint32_t);
 uint32_t hv2_mmu_get_phys(hv2_t*, uint32_t, int);
 void hv2_mmu_attach_device(hv2_t*, hv2_mmio_device_t*);
-void hv2_mmu_create_mapping(hv2_t*, int, const hv2_mmu_entry_t&);
\ No newline at end of file
+void hv2_mmu_create_mapping(hv2_t*, int, const hv2_mmu_entry_t&);
+uint8_t* hv2_mmu_get_dma_ptr(hv2_t*, uint32_t, uint32_t);
+bool hv2_mmu_dma_read(hv2_t*, uint32_t, void*, uint32_t);
+bool hv2_mmu_dma_write(hv2_t*, uint32_t, const void*, uint32_t);
\ No newline at end of file
@@ -17,4 +17,15 @@ public:
     virtual uint32_t read(uint32_t, int) = 0;
     virtual void write(uint32_t, uint32_t, int) = 0;
     virtual void master_clock() {};
+
+    // Host pointer to [addr, addr + size) for devices backed by plain
+    // memory, lets DMA-capable devices copy without going through
+    // read/write. nullptr if the range can't be accessed directly
+    virtual uint8_t* get_dma_ptr(uint32_t addr, uint32_t size) { return nullptr; };
+
+    // CPU accesses to I/O space devices are counted as HV2_PERF_IO
+    bool io_space = false;
+
+    // Cleared when memory decode is disabled through PCI
+    bool decode = true;
 };
\ No newline at end of file
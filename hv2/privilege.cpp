@@ -47,4 +47,20 @@ void hv2_privilege_down(hv2_t* cpu) {
     if (cpu->cop4_ctrl & MMU_CTRL_REMAP_ON_PLT) {
         cpu->cop4_i_cmap = cpu->pl;
     }
-}
\ No newline at end of file
+}
+/**
+ * @brief Switch register files on a privilege level change, only
+ *        if XSTACKED_ISR is enabled
+ *
+ * Transitions that don't change the level (i.e. exceptions taken
+ * at PL0) keep the same registers
+ */
+void hv2_privilege_swap_banks(hv2_t* cpu, int from, int to) {
+    if (!(cpu->cop0_cr0 & HV2_COP0_CR0_XSTACKED_ISR) || (from == to))
+        return;
+
+    constexpr size_t size = (HV2_BANK_LAST - HV2_BANK_FIRST + 1) * sizeof(uint32_t);
+
+    std::memcpy(&cpu->cop0_bank[from][HV2_BANK_FIRST], &cpu->r[HV2_BANK_FIRST], size);
+    std::memcpy(&cpu->r[HV2_BANK_FIRST], &cpu->cop0_bank[to][HV2_BANK_FIRST], size);
+}
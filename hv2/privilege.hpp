@@ -3,4 +3,5 @@
 struct hv2_t;
 
 void hv2_privilege_up(hv2_t*);
-void hv2_privilege_down(hv2_t*);
\ No newline at end of file
+void hv2_privilege_down(hv2_t*);
+void hv2_privilege_swap_banks(hv2_t*, int, int);
\ No newline at end of file
@@ -0,0 +1,298 @@
+#include "sched.hpp"
+#include "hv2.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+// std heap functions build max-heaps, invert the comparison
+static bool hv2_sched_later(const hv2_event_t& a, const hv2_event_t& b) {
+    if (a.deadline != b.deadline)
+        return a.deadline > b.deadline;
+
+    return a.id > b.id;
+}
+
+static void hv2_sched_update_deadline(hv2_sched_t* sched) {
+    sched->deadline.store(sched->heap.empty() ? UINT64_MAX : sched->heap.front().deadline);
+
+    // The store may have replaced the 0 of a notify that raced with
+    // it. Both sides are seq_cst, so either we see notified here or
+    // the notify's store lands after ours
+    if (sched->notified.load())
+        sched->deadline.store(0, std::memory_order_relaxed);
+}
+
+static void hv2_sched_push(hv2_sched_t* sched, const hv2_event_t& ev) {
+    sched->heap.push_back(ev);
+
+    std::push_heap(sched->heap.begin(), sched->heap.end(), hv2_sched_later);
+
+    // Fetch-min, a plain store could undo the 0 a concurrent notify
+    // just wrote
+    uint64_t cur = sched->deadline.load(std::memory_order_relaxed);
+
+    while ((ev.deadline < cur) && !sched->deadline.compare_exchange_weak(cur, ev.deadline, std::memory_order_relaxed));
+}
+
+hv2_sched_t* hv2_sched_create() {
+    return new hv2_sched_t;
+}
+
+void hv2_sched_destroy(hv2_sched_t* sched) {
+    delete sched;
+}
+
+/**
+ * @brief Schedule a one-shot event, must be called from the
+ *        emulation thread
+ *
+ * @param delay Cycles from now, 0 runs the event as soon as the
+ *        current instruction is done
+ * @return Event id, can be passed to hv2_sched_cancel
+ */
+uint64_t hv2_sched_add(hv2_sched_t* sched, uint64_t delay, hv2_event_fn_t fn, void* udata) {
+    uint64_t id = sched->next_id++;
+
+    hv2_sched_push(sched, { sched->now + delay, 0, id, fn, udata });
+
+    return id;
+}
+
+uint64_t hv2_sched_add_periodic(hv2_sched_t* sched, uint64_t period, hv2_event_fn_t fn, void* udata) {
+    uint64_t id = sched->next_id++;
+
+    period = std::max(period, (uint64_t)1);
+
+    hv2_sched_push(sched, { sched->now + period, period, id, fn, udata });
+
+    return id;
+}
+
+bool hv2_sched_cancel(hv2_sched_t* sched, uint64_t id) {
+    auto it = std::find_if(sched->heap.begin(), sched->heap.end(), [id](const hv2_event_t& ev) {
+        return ev.id == id;
+    });
+
+    if (it == sched->heap.end())
+        return false;
+
+    sched->heap.erase(it);
+
+    std::make_heap(sched->heap.begin(), sched->heap.end(), hv2_sched_later);
+
+    hv2_sched_update_deadline(sched);
+
+    return true;
+}
+
+void hv2_sched_watch(hv2_sched_t* sched, hv2_event_fn_t fn, void* udata) {
+    sched->watches.push_back({ fn, udata });
+}
+
+/**
+ * @brief Wake the emulation thread, safe to call from any thread.
+ *        The current run ends after the instruction in flight and
+ *        every watch is called
+ */
+void hv2_sched_notify(hv2_sched_t* sched) {
+    sched->notified.store(true);
+    sched->deadline.store(0);
+
+    // Both sides are seq_cst: either the idle thread sees notified
+    // before waiting, or we see it sleeping here and wake it up
+    if (!sched->sleeping.load())
+        return;
+
+    // Taking the lock orders us against an idle thread that checked
+    // notified but hasn't started waiting yet
+    {
+        std::lock_guard <std::mutex> lock(sched->idle_mutex);
+    }
+
+    sched->idle_cv.notify_one();
+}
+
+// End the current run after the instruction in flight, emulation
+// thread only
+void hv2_sched_break(hv2_sched_t* sched) {
+    sched->deadline.store(0, std::memory_order_relaxed);
+}
+
+// Like hv2_sched_notify, for the emulation thread: end the current
+// run and call every watch once it's over. Kicks from inside a watch
+// run the watches again before the CPU resumes
+void hv2_sched_kick(hv2_sched_t* sched) {
+    sched->notified.store(true, std::memory_order_release);
+
+    hv2_sched_break(sched);
+}
+
+static std::chrono::steady_clock::time_point hv2_sched_wall_time(hv2_sched_t* sched, uint64_t cycles) {
+    std::chrono::duration <double> offset((double)(cycles - sched->epoch_cycles) / sched->freq);
+
+    return sched->epoch + std::chrono::duration_cast <std::chrono::steady_clock::duration> (offset);
+}
+
+// Start counting wall-clock time from the current cycle
+static void hv2_sched_rebase(hv2_sched_t* sched) {
+    sched->epoch = std::chrono::steady_clock::now();
+    sched->epoch_cycles = sched->now;
+}
+
+// Sleep off whatever we're ahead of the wall clock. The schedule is
+// absolute, so oversleeping one slice is made up in the next ones
+static void hv2_sched_pace_event(void* udata) {
+    hv2_sched_t* sched = (hv2_sched_t*)udata;
+
+    auto target = hv2_sched_wall_time(sched, sched->now);
+    auto host = std::chrono::steady_clock::now();
+
+    if (target > host) {
+        std::this_thread::sleep_until(target);
+    } else if ((host - target) > HV2_SCHED_MAX_LAG) {
+        // The host can't keep up (or was suspended), running flat out
+        // to catch up would just make things stutter
+        hv2_sched_rebase(sched);
+    }
+}
+
+/**
+ * @brief Set the CPU frequency and whether to keep emulated time in
+ *        step with the wall clock
+ *
+ * @param freq Cycles per second
+ * @param realtime Pace execution and sleep while halted, run as fast
+ *        as possible otherwise
+ */
+void hv2_sched_set_pacing(hv2_sched_t* sched, double freq, bool realtime) {
+    sched->freq = freq;
+    sched->realtime = realtime;
+
+    if (sched->pace_event)
+        hv2_sched_cancel(sched, sched->pace_event);
+
+    sched->pace_event = 0;
+
+    hv2_sched_rebase(sched);
+
+    if (realtime)
+        sched->pace_event = hv2_sched_add_periodic(sched, freq / HV2_SCHED_SLICES_PER_SEC, hv2_sched_pace_event, sched);
+}
+
+// Earliest event other than pacing, which would wake a halted CPU
+// every slice for nothing
+static uint64_t hv2_sched_idle_target(hv2_sched_t* sched) {
+    uint64_t target = UINT64_MAX;
+
+    for (const hv2_event_t& ev : sched->heap)
+        if (ev.id != sched->pace_event)
+            target = std::min(target, ev.deadline);
+
+    return target;
+}
+
+static void hv2_sched_idle(hv2_sched_t* sched) {
+    uint64_t target = hv2_sched_idle_target(sched);
+
+    if (target <= sched->now)
+        return;
+
+    // Nothing is pending on other threads, skip the idle stretch
+    if (!sched->realtime && (target != UINT64_MAX)) {
+        sched->now = target;
+
+        return;
+    }
+
+    auto notified = [sched]() {
+        return sched->notified.load();
+    };
+
+    std::unique_lock <std::mutex> lock(sched->idle_mutex);
+
+    // Announce ourselves before checking notified, see hv2_sched_notify
+    sched->sleeping.store(true);
+
+    bool early = true;
+
+    if (target == UINT64_MAX) {
+        sched->idle_cv.wait(lock, notified);
+    } else {
+        early = sched->idle_cv.wait_until(lock, hv2_sched_wall_time(sched, target), notified);
+    }
+
+    sched->sleeping.store(false, std::memory_order_relaxed);
+
+    if (!early) {
+        sched->now = target;
+    } else if (sched->realtime) {
+        // Woken early, only account for the time actually spent
+        std::chrono::duration <double> elapsed = std::chrono::steady_clock::now() - sched->epoch;
+
+        uint64_t cycles = sched->epoch_cycles + (uint64_t)(elapsed.count() * sched->freq);
+
+        sched->now = std::clamp(cycles, sched->now, target);
+    }
+
+    if (!sched->realtime)
+        return;
+
+    // Pace from here on, the slices we slept through are gone
+    hv2_sched_rebase(sched);
+
+    hv2_sched_cancel(sched, sched->pace_event);
+
+    sched->pace_event = hv2_sched_add_periodic(sched, sched->freq / HV2_SCHED_SLICES_PER_SEC, hv2_sched_pace_event, sched);
+}
+
+void hv2_sched_dispatch(hv2_sched_t* sched) {
+    while (!sched->heap.empty() && (sched->heap.front().deadline <= sched->now)) {
+        std::pop_heap(sched->heap.begin(), sched->heap.end(), hv2_sched_later);
+
+        hv2_event_t ev = sched->heap.back();
+
+        sched->heap.pop_back();
+
+        // Re-arm before calling, so the callback can cancel it
+        if (ev.period) {
+            ev.deadline += ev.period;
+
+            hv2_sched_push(sched, ev);
+        }
+
+        ev.fn(ev.udata);
+    }
+
+    hv2_sched_update_deadline(sched);
+
+    // Checked after publishing the deadline, a notify racing with
+    // us either gets seen here or zeroes the deadline again
+    while (sched->notified.exchange(false, std::memory_order_acquire)) {
+        for (const hv2_sched_watch_t& w : sched->watches)
+            w.fn(w.udata);
+
+        // Watches may have scheduled events
+        hv2_sched_update_deadline(sched);
+    }
+}
+
+// Run the CPU up to the next deadline, then dispatch due events
+void hv2_sched_run(hv2_t* cpu, hv2_sched_t* sched) {
+    if (cpu->halted) {
+        uint64_t start = sched->now;
+
+        hv2_sched_idle(sched);
+
+        // Time spent halted still counts as cycles
+        cpu->perf_cycles += sched->now - start;
+    } else {
+        while (sched->now < sched->deadline.load(std::memory_order_relaxed)) {
+            hv2_cycle(cpu);
+
+            sched->now++;
+        }
+    }
+
+    hv2_sched_dispatch(sched);
+}
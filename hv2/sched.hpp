@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+
+struct hv2_t;
+
+// Called with the event's udata once its deadline is reached
+typedef void (*hv2_event_fn_t)(void*);
+
+struct hv2_event_t {
+    uint64_t deadline;
+    uint64_t period;    // Re-armed every period cycles if non-zero
+    uint64_t id;
+    hv2_event_fn_t fn;
+    void* udata;
+};
+
+struct hv2_sched_watch_t {
+    hv2_event_fn_t fn;
+    void* udata;
+};
+
+/*
+    Timestamps are in CPU cycles. The CPU runs uninterrupted until
+    the earliest deadline, then every due event is dispatched.
+
+    deadline caches the earliest deadline so the run loop only
+    compares two integers per cycle. It's atomic so other threads
+    can cut a run short through hv2_sched_notify.
+
+    In real-time mode cycle epoch_cycles happens at wall-clock time
+    epoch, and every slice of cycles the emulation thread sleeps
+    until the matching wall-clock time.
+
+    While the CPU is halted (wfi) no cycles are run. In real-time
+    mode the emulation thread sleeps until the wall-clock time of
+    the next deadline, or until another thread notifies. Otherwise
+    now jumps straight to the next deadline.
+*/
+#define HV2_SCHED_SLICES_PER_SEC 1000
+
+// Further behind than this and we stop trying to catch up
+#define HV2_SCHED_MAX_LAG std::chrono::milliseconds(50)
+
+struct hv2_sched_t {
+    uint64_t now = 0;
+    uint64_t next_id = 1;
+
+    std::atomic <uint64_t> deadline = UINT64_MAX;
+    std::atomic <bool> notified = false;
+
+    // Min-heap ordered by deadline, then by id
+    std::vector <hv2_event_t> heap;
+
+    // Run on the emulation thread after a notify
+    std::vector <hv2_sched_watch_t> watches;
+
+    // Pacing and idle handling
+    bool realtime = false;
+    double freq = 1000000.0;
+    uint64_t pace_event = 0;
+
+    std::chrono::steady_clock::time_point epoch;
+    uint64_t epoch_cycles = 0;
+
+    std::mutex idle_mutex;
+    std::condition_variable idle_cv;
+
+    // Set while hv2_sched_idle waits on idle_cv, notifies skip the
+    // lock and the wakeup when it's clear
+    std::atomic <bool> sleeping = false;
+};
+
+hv2_sched_t* hv2_sched_create();
+void hv2_sched_destroy(hv2_sched_t*);
+uint64_t hv2_sched_add(hv2_sched_t*, uint64_t, hv2_event_fn_t, void*);
+uint64_t hv2_sched_add_periodic(hv2_sched_t*, uint64_t, hv2_event_fn_t, void*);
+bool hv2_sched_cancel(hv2_sched_t*, uint64_t);
+void hv2_sched_watch(hv2_sched_t*, hv2_event_fn_t, void*);
+void hv2_sched_notify(hv2_sched_t*);
+void hv2_sched_break(hv2_sched_t*);
+void hv2_sched_kick(hv2_sched_t*);
+void hv2_sched_set_pacing(hv2_sched_t*, double, bool);
+void hv2_sched_dispatch(hv2_sched_t*);
+void hv2_sched_run(hv2_t*, hv2_sched_t*);